@@ -0,0 +1,180 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+
+// measures the per-entry cost of formatting LIST lines, next to the snprintf
+// formatter that ftp_build_list_line() replaced.
+// usage: bench_list <dir> [localtime]
+
+// the formatter is static, so the server is built into the benchmark.
+#include "ftpsrv.c"
+
+#include <dirent.h>
+
+#define BENCH_MAX_ENTRIES (1024 * 64)
+#define BENCH_ROUNDS 10
+
+struct BenchEntry {
+    char name[256];
+    struct Pathname fullpath;
+    struct stat st;
+};
+
+static struct BenchEntry g_entries[BENCH_MAX_ENTRIES];
+
+// the formatter as it was before ftp_build_list_line().
+static int bench_snprintf_line(struct FtpSession* session, char* out, size_t size, const struct Pathname* fullpath, const char* name, const struct stat* st) {
+    static const char months[12][4] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+
+    char perms[11] = {0};
+    switch (st->st_mode & S_IFMT) {
+        case S_IFREG:   perms[0] = '-'; break;
+        case S_IFDIR:   perms[0] = 'd'; break;
+        case S_IFLNK:   perms[0] = 'l'; break;
+        case S_IFIFO:   perms[0] = 'p'; break;
+        case S_IFSOCK:  perms[0] = 's'; break;
+        case S_IFCHR:   perms[0] = 'c'; break;
+        case S_IFBLK:   perms[0] = 'b'; break;
+        default:        perms[0] = '?'; break;
+    }
+
+    perms[1] = (st->st_mode & S_IRUSR) ? 'r' : '-';
+    perms[2] = (st->st_mode & S_IWUSR) ? 'w' : '-';
+    perms[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
+    perms[4] = (st->st_mode & S_IRGRP) ? 'r' : '-';
+    perms[5] = (st->st_mode & S_IWGRP) ? 'w' : '-';
+    perms[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
+    perms[7] = (st->st_mode & S_IROTH) ? 'r' : '-';
+    perms[8] = (st->st_mode & S_IWOTH) ? 'w' : '-';
+    perms[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
+
+    struct Pathname symlink_path = {0};
+    if (perms[0] == 'l' && fullpath) {
+        strcpy(symlink_path.s, " -> ");
+        const int len = ftp_vfs_readlink(fullpath->s, symlink_path.s + strlen(symlink_path.s), sizeof(symlink_path) - strlen(symlink_path.s));
+        if (len < 0) {
+            symlink_path.s[0] = '\0';
+        }
+    }
+
+    struct tm tm = {0};
+    unpack_time(&st->st_mtime, &tm);
+
+    // if the time is greater than 6 months, show year rather than time
+    char date[6] = {0};
+    const long six_months = 60ll * 60ll * 24ll * (365ll / 2ll);
+    if (labs((long)difftime(session->last_update_time, st->st_mtime)) > six_months) {
+        snprintf(date, sizeof(date), "%5u", tm.tm_year + 1900);
+    } else {
+        snprintf(date, sizeof(date), "%02u:%02u", tm.tm_hour, tm.tm_min);
+    }
+
+    const unsigned nlink = st->st_nlink;
+    const size_t file_size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+
+    const int rc = snprintf(out, size, "%s %3u %s %s %13zu %s %3d %s %s%s" TELNET_EOL,
+        perms,
+        nlink,
+        ftp_vfs_getpwuid(st), ftp_vfs_getgrgid(st),
+        file_size,
+        months[tm.tm_mon], tm.tm_mday, date,
+        name, symlink_path.s);
+
+    if (rc <= 0 || rc >= size) {
+        return -1;
+    }
+    return rc;
+}
+
+static double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef int (*BenchFormat)(struct FtpSession* session, char* out, size_t size, const struct Pathname* fullpath, const char* name, const struct stat* st);
+
+// returns the best time per entry in ns, each round starts as a new listing would.
+static double bench_run(struct FtpSession* session, BenchFormat format, size_t count) {
+    struct FtpTransfer* transfer = session->transfer;
+    double best = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        memset(transfer->list_dates, 0, sizeof(transfer->list_dates));
+        const double start = bench_now();
+        for (size_t i = 0; i < count; i++) {
+            const struct BenchEntry* e = &g_entries[i];
+            format(session, transfer->list_buf, FTP_LISTENTRY_SIZE, &e->fullpath, e->name, &e->st);
+        }
+        const double elapsed = bench_now() - start;
+        if (!round || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    return best * 1e9 / count;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <dir> [localtime]\n", argv[0]);
+        return 1;
+    }
+
+    static struct FtpSrv ftp;
+    static struct FtpSession session;
+    ftp.cfg.use_localtime = argc > 2;
+    g_ftp = &ftp;
+
+    struct FtpTransfer* transfer = calloc(1, sizeof(*transfer));
+    if (!transfer) {
+        return 1;
+    }
+    transfer->mode = FTP_TRANSFER_MODE_LIST;
+    session.transfer = transfer;
+    session.last_update_time = time(NULL);
+
+    DIR* dir = opendir(argv[1]);
+    if (!dir) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    size_t count = 0;
+    struct dirent* d;
+    while (count < BENCH_MAX_ENTRIES && (d = readdir(dir))) {
+        struct BenchEntry* e = &g_entries[count];
+        const int rc = snprintf(e->fullpath.s, sizeof(e->fullpath), "%s/%s", argv[1], d->d_name);
+        if (rc > 0 && rc < sizeof(e->fullpath) && strlen(d->d_name) < sizeof(e->name) && !lstat(e->fullpath.s, &e->st)) {
+            strcpy(e->name, d->d_name);
+            count++;
+        }
+    }
+    closedir(dir);
+
+    if (!count) {
+        fprintf(stderr, "%s is empty\n", argv[1]);
+        return 1;
+    }
+
+    // both must produce the same listing for the numbers to mean anything.
+    char expected[FTP_LISTENTRY_SIZE];
+    for (size_t i = 0; i < count; i++) {
+        const struct BenchEntry* e = &g_entries[i];
+        const int a = bench_snprintf_line(&session, expected, sizeof(expected), &e->fullpath, e->name, &e->st);
+        const int b = ftp_build_list_line(&session, transfer->list_buf, FTP_LISTENTRY_SIZE, &e->fullpath, e->name, &e->st);
+        if (a != b || (a > 0 && memcmp(expected, transfer->list_buf, a))) {
+            fprintf(stderr, "output differs for %s\n", e->name);
+            return 1;
+        }
+    }
+
+    printf("%zu entries, %s\n", count, ftp.cfg.use_localtime ? "localtime" : "gmtime");
+    printf("snprintf:            %7.1f ns/entry\n", bench_run(&session, bench_snprintf_line, count));
+    printf("ftp_build_list_line: %7.1f ns/entry\n", bench_run(&session, ftp_build_list_line, count));
+    return 0;
+}
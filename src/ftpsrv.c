@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
@@ -22,7 +23,7 @@
 // helper which returns the size of array
 #define FTP_ARR_SZ(x) (sizeof(x) / sizeof(x[0]))
 
-// number of max concurrent sessions
+// default number of max concurrent sessions, can be changed at runtime.
 #ifndef FTP_MAX_SESSIONS
     #define FTP_MAX_SESSIONS 128
 #endif
@@ -32,25 +33,122 @@
     #define FTP_FILE_BUFFER_SIZE (1024 * 64) /* 64 KiB */
 #endif
 
+// number of free transfer buffers that are kept around for reuse.
+#ifndef FTP_FILE_BUFFER_POOL_SIZE
+    #define FTP_FILE_BUFFER_POOL_SIZE 4
+#endif
+
+// default number of pending connections the listener may queue.
+#ifndef FTP_LISTEN_BACKLOG
+    #define FTP_LISTEN_BACKLOG 5
+#endif
+
+// how long the listener stops being polled for once accept() runs out of fds, unless a session is freed first.
+#ifndef FTP_ACCEPT_BACKOFF_MS
+    #define FTP_ACCEPT_BACKOFF_MS 100
+#endif
+
+// default number of bytes a ready transfer may move each loop, scaled by the session weight.
+#ifndef FTP_TRANSFER_QUANTUM
+    #define FTP_TRANSFER_QUANTUM FTP_FILE_BUFFER_SIZE
+#endif
+
 // size of the max length of pathname
 #ifndef FTP_PATHNAME_SIZE
     #define FTP_PATHNAME_SIZE 4096
 #endif
 
+// LIST / NLST entries are staged in a buffer of this size so that many
+// entries are sent at once.
+#ifndef FTP_LISTBUF_SIZE
+    #define FTP_LISTBUF_SIZE (1024 * 16)
+#endif
+
 // the below shouldn't be messed with, it will *not* improve
 // performance and will greatly increase memory usage at higher values.
-#ifndef FTP_LISTBUF_SIZE
-    #define FTP_LISTBUF_SIZE 1024
+#ifndef FTP_LISTENTRY_SIZE
+    #define FTP_LISTENTRY_SIZE 1024
+#endif
+
+// max bytes of formatted listings kept in memory by all servers, 0 disables the cache.
+// a listing is served from the cache until a command writes to the dir or its mtime changes.
+#ifndef FTP_LIST_CACHE_SIZE
+    #define FTP_LIST_CACHE_SIZE 0
+#endif
+
+// max bytes of a single cached listing, larger listings are sent without being cached.
+// listings being recorded are also limited to FTP_LIST_CACHE_SIZE bytes in total.
+#ifndef FTP_LIST_CACHE_ENTRY_SIZE
+    #define FTP_LIST_CACHE_ENTRY_SIZE (FTP_LIST_CACHE_SIZE / 8)
+#endif
+
+// number of entries read from the dir at once if the vfs supports it.
+#ifndef FTP_DIR_BATCH_SIZE
+    #define FTP_DIR_BATCH_SIZE 128
 #endif
 
 #ifndef FTP_CMDBUF_SIZE
     #define FTP_CMDBUF_SIZE 1024
 #endif
 
+// max length of a single reply.
 #ifndef FTP_SENDBUF_SIZE
     #define FTP_SENDBUF_SIZE 1024
 #endif
 
+// replies are queued until the control socket is writable, so that
+// pipelined commands don't lose their replies.
+#ifndef FTP_SENDQUEUE_SIZE
+    #define FTP_SENDQUEUE_SIZE (FTP_SENDBUF_SIZE * 4)
+#endif
+
+// set by the socket header if it supports persistent polling.
+#ifndef FTP_SOCKET_POLL_SET
+    #define FTP_SOCKET_POLL_SET 0
+#endif
+
+// set by the vfs header if it can transfer between a file and socket itself.
+#ifndef FTP_VFS_SENDFILE
+    #define FTP_VFS_SENDFILE 0
+#endif
+
+#ifndef FTP_VFS_RECVFILE
+    #define FTP_VFS_RECVFILE 0
+#endif
+
+#ifndef FTP_VFS_SPAN
+    #define FTP_VFS_SPAN 0
+#endif
+
+#ifndef FTP_VFS_ASYNC
+    #define FTP_VFS_ASYNC 0
+#endif
+
+// set by the vfs header if ftp_vfs_dirlstat() doesn't need the full path.
+#ifndef FTP_VFS_DIRLSTAT_AT
+    #define FTP_VFS_DIRLSTAT_AT 0
+#endif
+
+#ifndef FTP_VFS_READDIR_BATCH
+    #define FTP_VFS_READDIR_BATCH 0
+#endif
+
+// if set, each thread that calls ftpsrv_init() runs its own server with
+// its own listener, sessions and transfer buffer.
+#ifndef FTP_THREADS
+    #define FTP_THREADS 0
+#endif
+
+#if FTP_THREADS && FTP_LIST_CACHE_SIZE
+    #include <pthread.h>
+#endif
+
+#if FTP_THREADS
+    #define FTP_THREAD_LOCAL __thread
+#else
+    #define FTP_THREAD_LOCAL
+#endif
+
 #define TELNET_EOL "\r\n"
 
 enum FTP_TYPE {
@@ -84,6 +182,17 @@ enum FTP_TRANSFER_MODE {
     FTP_TRANSFER_MODE_STOR, // transfer using STOR
     FTP_TRANSFER_MODE_LIST, // transfer using LIST
     FTP_TRANSFER_MODE_NLST, // transfer using NLST
+    FTP_TRANSFER_MODE_MLSD, // transfer using MLSD
+};
+
+// RFC 3659 facts that MLSD / MLST output, selected with OPTS MLST.
+enum FTP_MLST_FACT {
+    FTP_MLST_FACT_TYPE   = 1 << 0,
+    FTP_MLST_FACT_SIZE   = 1 << 1,
+    FTP_MLST_FACT_MODIFY = 1 << 2,
+    FTP_MLST_FACT_PERM   = 1 << 3,
+    FTP_MLST_FACT_UNIQUE = 1 << 4,
+    FTP_MLST_FACT_ALL    = (1 << 5) - 1,
 };
 
 enum FTP_AUTH_MODE {
@@ -96,7 +205,7 @@ enum FTP_SESSION_STATE {
     FTP_SESSION_STATE_NONE,     // not active.
     FTP_SESSION_STATE_POLLIN,   // waiting for commands.
     FTP_SESSION_STATE_POLLOUT,  // sending message to client.
-    // FTP_SESSION_STATE_BLOCKING, // executing a command which is not async, but may block.
+    FTP_SESSION_STATE_BLOCKING, // executing a command which is not async, but may block.
 };
 
 enum FTP_FILE_TRANSFER_STATE {
@@ -110,6 +219,45 @@ struct Pathname {
     char s[FTP_PATHNAME_SIZE];
 };
 
+// constant reply with the code already prepended, see FTP_REPLY().
+struct FtpReply {
+    unsigned code;
+    size_t len;
+    const char* s;
+};
+
+// code must be a literal so that the whole reply is built at compile time.
+#define FTP_REPLY(code, msg) (&(const struct FtpReply){ (code), sizeof(#code " " msg) - 1, #code " " msg })
+
+// everything that the listing of a dir is formatted with, the cache is shared by all servers.
+struct FtpListCacheKey {
+    enum FTP_TRANSFER_MODE mode;
+    unsigned mlst_facts; // only set for MLSD.
+    bool read_only; // only set for MLSD, changes the perm fact.
+    bool use_localtime; // only set for LIST, MLSD dates are always UTC.
+    long long day; // only set for LIST, which shows the year rather than the time of dates over six months away.
+};
+
+// formatted LIST / NLST / MLSD output of a dir, immutable once cached.
+struct FtpListCacheEntry {
+    struct FtpListCacheEntry* next; // next least recently used.
+    unsigned refs; // transfers sending the listing, +1 whilst cached.
+    unsigned gen; // cache generation when the dir was opened.
+    struct FtpListCacheKey key;
+    time_t mtime; // of the dir when it was opened.
+    size_t size;
+    size_t capacity; // only used whilst recording.
+    struct Pathname path;
+    char data[];
+};
+
+// broken down time of a day in a listing, see ftp_list_date().
+struct FtpListDate {
+    time_t start;
+    time_t end; // the day is unused if start == end.
+    struct tm tm;
+};
+
 struct FtpTransfer {
     enum FTP_TRANSFER_MODE mode;
     bool connection_pending;
@@ -121,6 +269,31 @@ struct FtpTransfer {
     struct FtpVfsFile file_vfs;
     struct FtpVfsDir dir_vfs;
 
+    // borrowed from the pool during RETR and STOR.
+    // data between buf_offset and buf_size has yet to be sent / written.
+    unsigned char* buf;
+    size_t buf_offset;
+    size_t buf_size;
+
+    // bytes that may still be moved this round, negative if the last round overshot.
+    long long deficit;
+
+    struct FtpListDate list_dates[8];
+
+#if FTP_VFS_READDIR_BATCH
+    // entries read from the dir, those before dir_index have been listed.
+    struct FtpVfsDirEntry dir_entries[FTP_DIR_BATCH_SIZE];
+    const char* dir_names[FTP_DIR_BATCH_SIZE];
+    size_t dir_index;
+    size_t dir_count;
+#endif
+
+#if FTP_LIST_CACHE_SIZE
+    struct FtpListCacheEntry* list_cached; // listing that is sent instead of reading the dir.
+    struct FtpListCacheEntry* list_record; // listing that is built whilst the dir is read.
+    struct Pathname upload_path; // file being written by STOR / APPE.
+#endif
+
     char list_buf[FTP_LISTBUF_SIZE];
 };
 
@@ -132,7 +305,10 @@ struct FtpSession {
     enum FTP_STRUCTURE structure;
     enum FTP_DATA_CONNECTION data_connection;
 
-    struct FtpTransfer transfer;
+    size_t index; // slot in the session table.
+    unsigned weight; // share of the transfer bandwidth.
+    unsigned mlst_facts; // enum FTP_MLST_FACT
+    struct FtpTransfer* transfer; // only allocated whilst a transfer is setup.
 
     struct FtpSocket control_sock; // socket for commands
     struct FtpSocket data_sock;    // socket for data (PORT/PASV)
@@ -146,15 +322,38 @@ struct FtpSession {
 
     time_t last_update_time; // time since sessions last updated
 
+    // deadlines in ms, only used if a timeout is set.
+    uint64_t control_deadline; // closes the session when idle.
+    uint64_t data_deadline; // aborts a transfer that is pending or stalled, 0 if none.
+    size_t timer_slot; // position in the timer heap + 1, 0 if not queued.
+
+    // received commands, cmd_buf_size bytes starting at cmd_buf_offset have yet to be run.
     char cmd_buf[FTP_CMDBUF_SIZE];
+    size_t cmd_buf_offset;
     size_t cmd_buf_size;
+    size_t cmd_buf_scan; // bytes already searched for TELNET_EOL.
+    bool cmd_buf_discard; // skipping the rest of a line that was too long.
 
-    char send_buf[FTP_SENDBUF_SIZE];
+    // queued replies, send_buf_size bytes starting at send_buf_offset have yet to be sent.
+    char send_buf[FTP_SENDQUEUE_SIZE];
     size_t send_buf_offset;
     size_t send_buf_size;
+    bool send_deferred; // set whilst pipelined commands are processed, replies are sent together.
 
     struct Pathname pwd;   // current directory
     struct Pathname temp_path; // rename from buffer / LIST fullpath
+
+#if FTP_VFS_ASYNC
+    struct FtpSessionJob* job; // command running on a worker, only set whilst blocking.
+    bool job_expired; // timed out whilst blocking, closed once the command completes.
+#endif
+
+#if FTP_SOCKET_POLL_SET
+    // what is currently registered in the poll set.
+    enum FtpSocketPollType poll_control_events;
+    enum FtpSocketPollType poll_data_events;
+    struct FtpSocket* poll_data_sock;
+#endif
 };
 
 struct FtpCommand {
@@ -163,20 +362,95 @@ struct FtpCommand {
     bool auth_required;
     bool args_required;
     bool data_connection_required;
+    bool blocking; // touches the vfs, run on a worker if available.
+};
+
+// entry of the command lookup table, id is 1 + the index into FTP_COMMANDS followed by the custom commands.
+struct FtpCommandSlot {
+    uint32_t verb; // see ftp_cmd_verb().
+    unsigned id; // 0 if the slot is unused.
+};
+
+#if FTP_VFS_ASYNC
+struct FtpSessionJob {
+    struct FtpVfsAsyncJob job;
+    struct FtpSrv* ftp;
+    struct FtpSession* session;
+    const struct FtpCommand* cmd;
+    char args[FTP_CMDBUF_SIZE];
+
+    // messages logged by the command, each is the log type followed by the NULL terminated message.
+    // they are passed to the log callback on the loop once the command completes.
+    char logs[FTP_SENDQUEUE_SIZE];
+    size_t logs_size;
 };
+#endif
 
-struct Ftp {
-    int initialised;
+struct FtpSrv {
     struct FtpSocket server_sock;
+    uint64_t accept_paused; // time in ms at which the listener is polled again, 0 if not paused.
 
+    // session table, NULL entries are free slots.
+    struct FtpSession** sessions;
+    size_t* free_slots;
+    size_t free_slot_count;
+    size_t max_sessions;
     unsigned session_count;
-    struct FtpSession sessions[FTP_MAX_SESSIONS];
+    size_t transfer_quantum;
+
+    // min-heap of sessions ordered by their next deadline.
+    struct FtpSession** timer_heap;
+    size_t timer_count;
+
+#if FTP_SOCKET_POLL_SET
+    struct FtpSocketPollSet poll_set;
+    struct FtpSocketPollEvent* poll_events;
+#else
+    struct FtpSocketPollEntry* poll_entries;
+    struct FtpSocketPollFd* poll_fds;
+#endif
+
+    // free transfer buffers.
+    unsigned char* buf_pool[FTP_FILE_BUFFER_POOL_SIZE];
+    size_t buf_pool_count;
+
+    // open addressed table of the built-in and custom commands, 1 << command_bits slots.
+    struct FtpCommandSlot* commands;
+    unsigned command_bits;
+
+#if FTP_VFS_ASYNC
+    struct FtpVfsAsync* async; // NULL if commands are run on the loop.
+#endif
 
-    unsigned char data_buf[FTP_FILE_BUFFER_SIZE];
     struct FtpSrvConfig cfg;
 };
 
-static struct Ftp g_ftp = {0};
+// the server that is currently being run, set on entry to the public api.
+static FTP_THREAD_LOCAL struct FtpSrv* g_ftp = NULL;
+// the server used by ftpsrv_init(), ftpsrv_loop() and ftpsrv_exit().
+static FTP_THREAD_LOCAL struct FtpSrv* g_ftp_default = NULL;
+#if FTP_VFS_ASYNC
+// the job run by a worker thread, which must not touch state shared between sessions.
+static FTP_THREAD_LOCAL struct FtpSessionJob* g_ftp_job = NULL;
+#endif
+
+#if FTP_LIST_CACHE_SIZE
+// shared by all servers so that a write on one invalidates the listings of all.
+static struct {
+    struct FtpListCacheEntry* head; // most recently used first.
+    size_t size; // bytes of listings cached.
+    size_t recording; // bytes allocated by listings being recorded.
+    unsigned gen; // bumped whenever listings are invalidated.
+    unsigned servers; // the cache is cleared once the last server exits.
+#if FTP_THREADS
+    pthread_mutex_t mutex;
+#endif
+} g_list_cache = {
+#if FTP_THREADS
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+#endif
+};
+#endif
 
 #if !HAVE_STRNCASECMP
 static int strncasecmp(const char* a, const char* b, size_t len) {
@@ -190,22 +464,31 @@ static int strncasecmp(const char* a, const char* b, size_t len) {
 }
 #endif
 
+// MLSD / MLST times are always UTC, see RFC 3659 section 2.3.
+static struct tm* unpack_utc_time(const time_t* timer, struct tm* buf) {
+#if defined(HAVE_GMTIME_R) && HAVE_GMTIME_R
+    struct tm* r = gmtime_r(timer, buf);
+#else
+    struct tm* r = gmtime(timer);
+#endif
+
+    if (r) {
+        *buf = *r;
+    }
+
+    return r;
+}
+
 static struct tm* unpack_time(const time_t* timer, struct tm* buf) {
-    struct tm* r;
+    if (!g_ftp->cfg.use_localtime) {
+        return unpack_utc_time(timer, buf);
+    }
 
-    if (g_ftp.cfg.use_localtime) {
 #if defined(HAVE_LOCALTIME_R) && HAVE_LOCALTIME_R
-        r = localtime_r(timer, buf);
+    struct tm* r = localtime_r(timer, buf);
 #else
-        r = localtime(timer);
+    struct tm* r = localtime(timer);
 #endif
-    } else {
-#if defined(HAVE_GMTIME_R) && HAVE_GMTIME_R
-        r = gmtime_r(timer, buf);
-#else
-        r = gmtime(timer);
-#endif
-    }
 
     if (r) {
         *buf = *r;
@@ -214,15 +497,33 @@ static struct tm* unpack_time(const time_t* timer, struct tm* buf) {
     return r;
 }
 
-static size_t ftp_get_timestamp_ms(void) {
+static uint64_t ftp_get_timestamp_ms(void) {
+#if defined(HAVE_CLOCK_GETTIME) && HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_nsec / 1000000ULL;
+#else
     struct timeval ts;
     gettimeofday(&ts, NULL);
-    return (ts.tv_sec * 1000000UL + ts.tv_usec) / 1000UL;
+    return (uint64_t)ts.tv_sec * 1000ULL + (uint64_t)ts.tv_usec / 1000ULL;
+#endif
 }
 
 static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
-    if (g_ftp.cfg.log_callback) {
-        g_ftp.cfg.log_callback(type, msg);
+    if (g_ftp->cfg.log_callback) {
+#if FTP_VFS_ASYNC
+        // the callback is only ever called from the loop, messages that don't fit are dropped.
+        if (g_ftp_job) {
+            const size_t len = strlen(msg) + 1;
+            if (g_ftp_job->logs_size + 1 + len <= sizeof(g_ftp_job->logs)) {
+                g_ftp_job->logs[g_ftp_job->logs_size] = type;
+                memcpy(g_ftp_job->logs + g_ftp_job->logs_size + 1, msg, len);
+                g_ftp_job->logs_size += 1 + len;
+            }
+            return;
+        }
+#endif
+        g_ftp->cfg.log_callback(type, msg);
     }
 }
 
@@ -241,284 +542,1011 @@ static void ftp_set_data_socket_options(struct FtpSocket* sock) {
 
 static inline unsigned socket_bind_port(void) {
     static unsigned port = 49152;
+#if FTP_THREADS
+    // shared between threads so that they don't hand out the same port.
+    unsigned ret = __atomic_load_n(&port, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&port, &ret, (ret == 65535) ? 49152 : ret + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+#else
     const unsigned ret = port;
     port = (port == 65535) ? 49152 : port + 1;
+#endif
     return ret;
 }
 
-// removes dangling '/' and duplicate '/' and converts '\\' to '/'
-static void remove_slashes(struct Pathname* pathname) {
-    int match = 0;
-    size_t offset = 0;
-    size_t len = strlen(pathname->s);
+// resolves path against the pwd into an absolute path, collapsing '/', '\\', "." and "..", where ".." stops at the root.
+// returns the number of segments in the path or -1 if it does not fit, out is always NULL terminated.
+static int build_fullpath(const struct FtpSession* session, struct Pathname* out, const char* path) {
+    size_t len = 1;
+    int segments = 0;
+    out->s[0] = '/';
 
-    while (offset < len) {
-        if (pathname->s[offset] == '\\') {
-            pathname->s[offset] = '/';
+    // the pwd is already resolved.
+    if (path[0] != '/' && path[0] != '\\') {
+        len = strlen(session->pwd.s);
+        memcpy(out->s, session->pwd.s, len);
+        for (size_t i = 0; len > 1 && i < len; i++) {
+            segments += out->s[i] == '/';
         }
+    }
 
-        if (pathname->s[offset] == '/') {
-            if (match == 1) {
-                memmove(pathname->s + offset, pathname->s + offset + 1, len - offset);
-                len--;
-            } else {
-                match = 1;
-                offset++;
+    while (*path) {
+        if (*path == '/' || *path == '\\') {
+            path++;
+            continue;
+        }
+
+        const size_t seg_len = strcspn(path, "/\\");
+        if (seg_len == 1 && path[0] == '.') {
+        } else if (seg_len == 2 && path[0] == '.' && path[1] == '.') {
+            if (segments) {
+                while (out->s[--len] != '/') {
+                }
+                len += !len;
+                segments--;
             }
         } else {
-            match = 0;
-            offset++;
+            if (len + (len > 1) + seg_len >= sizeof(out->s)) {
+                out->s[len] = '\0';
+                errno = ENAMETOOLONG;
+                return -1;
+            }
+
+            if (len > 1) {
+                out->s[len++] = '/';
+            }
+            memcpy(out->s + len, path, seg_len);
+            len += seg_len;
+            segments++;
         }
+        path += seg_len;
     }
 
-    if (len > 1 && pathname->s[len - 1] == '/') {
-        pathname->s[len - 1] = '\0';
+    out->s[len] = '\0';
+    return segments;
+}
+
+static uint64_t ftp_session_deadline(const struct FtpSession* session) {
+    // whilst blocking, the transfer is left alone until the command completes.
+    if (session->state != FTP_SESSION_STATE_BLOCKING && session->data_deadline && session->data_deadline < session->control_deadline) {
+        return session->data_deadline;
     }
+    return session->control_deadline;
 }
 
-static int build_fullpath(const struct FtpSession* session, struct Pathname* out, struct Pathname pathname) {
-    int rc = 0;
-    remove_slashes(&pathname);
+static void ftp_timer_swap(size_t a, size_t b) {
+    struct FtpSession* tmp = g_ftp->timer_heap[a];
+    g_ftp->timer_heap[a] = g_ftp->timer_heap[b];
+    g_ftp->timer_heap[b] = tmp;
+    g_ftp->timer_heap[a]->timer_slot = a + 1;
+    g_ftp->timer_heap[b]->timer_slot = b + 1;
+}
 
-    // check if it's the fullpath
-    if (pathname.s[0] == '/') {
-        strcpy(out->s, pathname.s);
-    } else if (!strcmp("..", pathname.s)) {
-        strcpy(out->s, session->pwd.s);
+static void ftp_timer_sift(size_t i) {
+    // move up.
+    while (i && ftp_session_deadline(g_ftp->timer_heap[i]) < ftp_session_deadline(g_ftp->timer_heap[(i - 1) / 2])) {
+        ftp_timer_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
 
-        char* last_slash = strrchr(out->s, '/');
-        if (!last_slash || last_slash == out->s) {
-            strcpy(out->s, "/");
-        } else {
-            if (strlen(last_slash) > 1) {
-                last_slash[0] = '\0';
-            }
+    // move down.
+    while (1) {
+        const size_t l = i * 2 + 1;
+        const size_t r = i * 2 + 2;
+        size_t min = i;
+
+        if (l < g_ftp->timer_count && ftp_session_deadline(g_ftp->timer_heap[l]) < ftp_session_deadline(g_ftp->timer_heap[min])) {
+            min = l;
         }
-    } else {
-        if (session->pwd.s[strlen(session->pwd.s) - 1] != '/') {
-            rc = snprintf(out->s, sizeof(*out), "%s/%s", session->pwd.s, pathname.s);
-        } else {
-            rc = snprintf(out->s, sizeof(*out), "%s%s", session->pwd.s, pathname.s);
+        if (r < g_ftp->timer_count && ftp_session_deadline(g_ftp->timer_heap[r]) < ftp_session_deadline(g_ftp->timer_heap[min])) {
+            min = r;
         }
+        if (min == i) {
+            break;
+        }
+
+        ftp_timer_swap(i, min);
+        i = min;
     }
+}
 
-    // return an error if the output was truncated or it failed.
-    if (rc < 0 || rc >= sizeof(*out)) {
-        rc = -1;
-    } else {
-        rc = 0;
+static void ftp_timer_remove(struct FtpSession* session) {
+    if (session->timer_slot) {
+        const size_t i = session->timer_slot - 1;
+        session->timer_slot = 0;
+
+        if (i != --g_ftp->timer_count) {
+            g_ftp->timer_heap[i] = g_ftp->timer_heap[g_ftp->timer_count];
+            g_ftp->timer_heap[i]->timer_slot = i + 1;
+            ftp_timer_sift(i);
+        }
     }
+}
 
-    return rc;
+// (re)queues the session after its deadlines changed.
+static void ftp_timer_update(struct FtpSession* session) {
+    if (!session->timer_slot) {
+        g_ftp->timer_heap[g_ftp->timer_count++] = session;
+        session->timer_slot = g_ftp->timer_count;
+    }
+    ftp_timer_sift(session->timer_slot - 1);
 }
 
+// blocking sessions are left alone, they are requeued by the loop once the command completes.
 static void ftp_update_session_time(struct FtpSession* session) {
-    if (session->state != FTP_SESSION_STATE_NONE) {
+    if (session->state != FTP_SESSION_STATE_NONE && session->state != FTP_SESSION_STATE_BLOCKING) {
         session->last_update_time = time(NULL);
+        if (g_ftp->cfg.timeout) {
+            session->control_deadline = ftp_get_timestamp_ms() + g_ftp->cfg.timeout * 1000ULL;
+            ftp_timer_update(session);
+        }
     }
 }
 
-// SOURCE: https://cr.yp.to/ftp/list/binls.html
-static int ftp_build_list_entry(struct FtpSession* session, const struct Pathname* fullpath, const char* name, const struct stat* st) {
-    int rc;
-    struct FtpTransfer* transfer = &session->transfer;
-
-    if (transfer->mode == FTP_TRANSFER_MODE_NLST) {
-        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s" TELNET_EOL, name);
-    } else {
-        static const char months[12][4] = {
-            "Jan", "Feb", "Mar", "Apr", "May", "Jun",
-            "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
-        };
-
-        char perms[11] = {0};
-        switch (st->st_mode & S_IFMT) {
-            case S_IFREG:   perms[0] = '-'; break;
-            case S_IFDIR:   perms[0] = 'd'; break;
-            case S_IFLNK:   perms[0] = 'l'; break;
-            case S_IFIFO:   perms[0] = 'p'; break;
-            case S_IFSOCK:  perms[0] = 's'; break;
-            case S_IFCHR:   perms[0] = 'c'; break;
-            case S_IFBLK:   perms[0] = 'b'; break;
-            default:        perms[0] = '?'; break;
-        }
-
-        perms[1] = (st->st_mode & S_IRUSR) ? 'r' : '-';
-        perms[2] = (st->st_mode & S_IWUSR) ? 'w' : '-';
-        perms[3] = (st->st_mode & S_IXUSR) ? 'x' : '-';
-        perms[4] = (st->st_mode & S_IRGRP) ? 'r' : '-';
-        perms[5] = (st->st_mode & S_IWGRP) ? 'w' : '-';
-        perms[6] = (st->st_mode & S_IXGRP) ? 'x' : '-';
-        perms[7] = (st->st_mode & S_IROTH) ? 'r' : '-';
-        perms[8] = (st->st_mode & S_IWOTH) ? 'w' : '-';
-        perms[9] = (st->st_mode & S_IXOTH) ? 'x' : '-';
-
-        struct Pathname symlink_path = {0};
-        if (perms[0] == 'l') {
-            strcpy(symlink_path.s, " -> ");
-            const int len = ftp_vfs_readlink(fullpath->s, symlink_path.s + strlen(symlink_path.s), sizeof(symlink_path) - strlen(symlink_path.s));
-            if (len < 0) {
-                symlink_path.s[0] = '\0';
-            }
-        }
+// data activity also counts as session activity.
+static void ftp_update_transfer_time(struct FtpSession* session) {
+    if (session->state != FTP_SESSION_STATE_NONE && session->transfer && g_ftp->cfg.timeout) {
+        session->data_deadline = ftp_get_timestamp_ms() + g_ftp->cfg.timeout * 1000ULL;
+    }
+    ftp_update_session_time(session);
+}
 
-        struct tm tm = {0};
-        unpack_time(&st->st_mtime, &tm);
+static const struct FtpMlstFact {
+    char name[7];
+    enum FTP_MLST_FACT fact;
+} FTP_MLST_FACTS[] = {
+    { "type", FTP_MLST_FACT_TYPE },
+    { "size", FTP_MLST_FACT_SIZE },
+    { "modify", FTP_MLST_FACT_MODIFY },
+    { "perm", FTP_MLST_FACT_PERM },
+    { "unique", FTP_MLST_FACT_UNIQUE },
+};
 
-        // if the time is greater than 6 months, show year rather than time
-        char date[6] = {0};
-        const long six_months = 60ll * 60ll * 24ll * (365ll / 2ll);
-        if (labs((long)difftime(session->last_update_time, st->st_mtime)) > six_months) {
-            snprintf(date, sizeof(date), "%5u", tm.tm_year + 1900);
-        } else {
-            snprintf(date, sizeof(date), "%02u:%02u", tm.tm_hour, tm.tm_min);
-        }
+static char* ftp_fmt_str(char* p, const char* str) {
+    while (*str) {
+        *p++ = *str++;
+    }
+    return p;
+}
 
-        const unsigned nlink = st->st_nlink;
-        const size_t size = S_ISDIR(st->st_mode) ? 0 : st->st_size;
+static char* ftp_fmt_uint(char* p, unsigned long long v, unsigned base) {
+    char tmp[24];
+    size_t n = 0;
+    do {
+        tmp[n++] = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
 
-        rc = snprintf(transfer->list_buf, sizeof(transfer->list_buf), "%s %3u %s %s %13zu %s %3d %s %s%s" TELNET_EOL,
-            perms,
-            nlink,
-            ftp_vfs_getpwuid(st), ftp_vfs_getgrgid(st),
-            size,
-            months[tm.tm_mon], tm.tm_mday, date,
-            name, symlink_path.s);
+    while (n) {
+        *p++ = tmp[--n];
     }
+    return p;
+}
 
-    // don't send anything on error or truncated
-    if (rc <= 0 || rc > sizeof(transfer->list_buf)) {
-        rc = -1;
-    } else {
-        transfer->size = rc;
+// zero padded to width.
+static char* ftp_fmt_digits(char* p, unsigned v, unsigned width) {
+    for (unsigned i = width; i--; v /= 10) {
+        p[i] = '0' + v % 10;
     }
-
-    return rc;
+    return p + width;
 }
 
-static void ftp_session_send(struct FtpSession* session);
+// writes the enabled facts as "type*;size*;" for FEAT, or "type;size;" for OPTS.
+static void ftp_build_mlst_facts(const struct FtpSession* session, char* out, bool feat) {
+    for (size_t i = 0; i < FTP_ARR_SZ(FTP_MLST_FACTS); i++) {
+        const bool enabled = session->mlst_facts & FTP_MLST_FACTS[i].fact;
+        if (feat || enabled) {
+            out = ftp_fmt_str(out, FTP_MLST_FACTS[i].name);
+            if (feat && enabled) {
+                *out++ = '*';
+            }
+            *out++ = ';';
+        }
+    }
+    *out = '\0';
+}
 
-static void ftp_client_msg(struct FtpSession* session, unsigned code, const char* fmt, ...) {
-    // prepend with the code.
-    const size_t size = sizeof(session->send_buf);
-    const size_t code_len = snprintf(session->send_buf, size, "%u ", code);
-    const size_t eol_padding = code_len * 2 + 4 + 3;
+// formats "fact=value;... name" followed by TELNET_EOL, returns the length or -1 if it doesn't fit.
+static int ftp_build_mlst_entry(const struct FtpSession* session, char* out, size_t size, const char* name, const struct stat* st) {
+    const unsigned facts = session->mlst_facts;
+    const bool is_dir = S_ISDIR(st->st_mode);
+    char* p = out;
 
-    // append message.
-    va_list va;
-    va_start(va, fmt);
-    vsnprintf(session->send_buf + code_len, size - eol_padding, fmt, va);
-    va_end(va);
+    // the facts are at most ~120 bytes, only the name needs checking.
+    const size_t name_len = strlen(name);
+    if (name_len + 128 >= size) {
+        return -1;
+    }
 
-    // if multiline message, append END.
-    const size_t len = strlen(session->send_buf);
-    if (len > code_len && session->send_buf[code_len] == '-') {
-        memmove(session->send_buf + code_len - 1, session->send_buf + code_len, len - code_len);
-        snprintf(session->send_buf + len - 1, size - len - 3, "%d END", code);
+    if (facts & FTP_MLST_FACT_TYPE) {
+        p = ftp_fmt_str(p, is_dir ? "type=dir;" : "type=file;");
     }
 
-    if (code < 400) {
-        ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, session->send_buf);
-    } else {
-        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, session->send_buf);
+    if ((facts & FTP_MLST_FACT_SIZE) && !is_dir) {
+        p = ftp_fmt_str(p, "size=");
+        p = ftp_fmt_uint(p, st->st_size, 10);
+        *p++ = ';';
     }
 
-    // finally, append EOL and send message.
-    strcat(session->send_buf, TELNET_EOL);
-    session->send_buf_offset = 0;
-    session->send_buf_size = strlen(session->send_buf);
-    session->state = FTP_SESSION_STATE_POLLOUT;
+    struct tm tm = {0};
+    if ((facts & FTP_MLST_FACT_MODIFY) && unpack_utc_time(&st->st_mtime, &tm)) {
+        p = ftp_fmt_str(p, "modify=");
+        p = ftp_fmt_digits(p, tm.tm_year + 1900, 4);
+        p = ftp_fmt_digits(p, tm.tm_mon + 1, 2);
+        p = ftp_fmt_digits(p, tm.tm_mday, 2);
+        p = ftp_fmt_digits(p, tm.tm_hour, 2);
+        p = ftp_fmt_digits(p, tm.tm_min, 2);
+        p = ftp_fmt_digits(p, tm.tm_sec, 2);
+        *p++ = ';';
+    }
 
-    // try to send immediately.
-    ftp_session_send(session);
-}
+    if (facts & FTP_MLST_FACT_PERM) {
+        const bool writeable = !g_ftp->cfg.read_only && (st->st_mode & S_IWUSR);
+        p = ftp_fmt_str(p, "perm=");
+        if (is_dir) {
+            p = ftp_fmt_str(p, writeable ? "elcmpfd" : "el");
+        } else {
+            p = ftp_fmt_str(p, writeable ? "rwadf" : "r");
+        }
+        *p++ = ';';
+    }
 
-static void ftp_data_transfer_end(struct FtpSession* session) {
-    switch (session->data_connection) {
-        case FTP_DATA_CONNECTION_NONE:
-            break;
-        case FTP_DATA_CONNECTION_ACTIVE:
-            ftp_socket_close(&session->data_sock);
-            break;
-        case FTP_DATA_CONNECTION_PASSIVE:
-            ftp_socket_close(&session->data_sock);
-            ftp_socket_close(&session->pasv_sock);
-            break;
+    if (facts & FTP_MLST_FACT_UNIQUE) {
+        p = ftp_fmt_str(p, "unique=");
+        p = ftp_fmt_uint(p, st->st_dev, 16);
+        *p++ = '.';
+        p = ftp_fmt_uint(p, st->st_ino, 16);
+        *p++ = ';';
     }
 
-    ftp_vfs_close(&session->transfer.file_vfs);
-    ftp_vfs_closedir(&session->transfer.dir_vfs);
+    *p++ = ' ';
+    memcpy(p, name, name_len);
+    p = ftp_fmt_str(p + name_len, TELNET_EOL);
+    *p = '\0';
 
-    session->transfer.connection_pending = false;
-    session->temp_path.s[0] = '\0';
-    session->transfer.offset = 0;
-    session->transfer.size = 0;
-    session->transfer.mode = FTP_TRANSFER_MODE_NONE;
-    session->data_connection = FTP_DATA_CONNECTION_NONE;
+    return p - out;
 }
 
-static void ftp_data_poll(struct FtpSession* session) {
-    int rc = 0;
+// space padded to width.
+static char* ftp_fmt_uint_pad(char* p, unsigned long long v, unsigned width) {
+    char tmp[24];
+    const size_t n = ftp_fmt_uint(tmp, v, 10) - tmp;
+    for (; width > n; width--) {
+        *p++ = ' ';
+    }
+    memcpy(p, tmp, n);
+    return p + n;
+}
 
-    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
-        rc = ftp_socket_connect(&session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr));
-        if (rc < 0) {
-            if (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY) {
-                // blocking...
-            } else if (errno == EISCONN) {
-                session->transfer.connection_pending = false;
-            } else {
-                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
-                ftp_data_transfer_end(session);
-            }
-        } else {
-            session->transfer.connection_pending = false;
+// sets tm to the broken down time of t, the days are cached as most entries of a listing share a few.
+static bool ftp_list_date(struct FtpTransfer* transfer, time_t t, struct tm* tm) {
+    struct FtpListDate* d = &transfer->list_dates[(unsigned long long)(t / 86400) % FTP_ARR_SZ(transfer->list_dates)];
+
+    if (t < d->start || t >= d->end) {
+        if (!unpack_time(&t, tm)) {
+            return false;
         }
-    } else {
-        size_t socklen = sizeof(session->pasv_sockaddr);
-        rc = ftp_socket_accept(&session->data_sock, &session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &socklen);
-        if (rc < 0) {
-            if (errno == EAGAIN || errno == EWOULDBLOCK) {
-                // blocking...
-            } else {
-                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
-                ftp_data_transfer_end(session);
-            }
-        } else {
-            ftp_set_data_socket_options(&session->data_sock);
-            session->transfer.connection_pending = false;
+
+        // only cache the day if the utc offset doesn't change during it.
+        struct tm last;
+        const time_t start = t - (tm->tm_hour * 60 * 60 + tm->tm_min * 60 + tm->tm_sec);
+        const time_t end = start + 60 * 60 * 24;
+        const time_t last_t = end - 1;
+        if (unpack_time(&last_t, &last) && last.tm_mday == tm->tm_mday && last.tm_hour == 23 && last.tm_min == 59 && last.tm_sec == 59) {
+            d->start = start;
+            d->end = end;
+            d->tm = *tm;
         }
+        return true;
     }
-}
 
-static void ftp_data_open(struct FtpSession* session, enum FTP_TRANSFER_MODE mode) {
-    int rc = 0;
-    ftp_client_msg(session, 150, "File status okay; about to open data connection.");
+    const unsigned secs = t - d->start;
+    *tm = d->tm;
+    tm->tm_hour = secs / (60 * 60);
+    tm->tm_min = secs / 60 % 60;
+    tm->tm_sec = secs % 60;
+    return true;
+}
 
-    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
-        rc = ftp_socket_open(&session->data_sock, PF_INET, SOCK_STREAM, 0);
-        if (rc >= 0) {
-            ftp_set_data_socket_options(&session->data_sock);
+// SOURCE: https://cr.yp.to/ftp/list/binls.html
+// formats a line of "ls -l", returns the length or -1 if it doesn't fit.
+static int ftp_build_list_line(struct FtpSession* session, char* out, size_t size, const struct Pathname* fullpath, const char* name, const struct stat* st) {
+    static const char months[12][4] = {
+        "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+        "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+    };
+
+    static const struct {
+        unsigned mode;
+        char c;
+    } bits[9] = {
+        { S_IRUSR, 'r' }, { S_IWUSR, 'w' }, { S_IXUSR, 'x' },
+        { S_IRGRP, 'r' }, { S_IWGRP, 'w' }, { S_IXGRP, 'x' },
+        { S_IROTH, 'r' }, { S_IWOTH, 'w' }, { S_IXOTH, 'x' },
+    };
+
+    char symlink_path[FTP_LISTENTRY_SIZE];
+    int symlink_len = 0;
+    if (S_ISLNK(st->st_mode) && fullpath) {
+        symlink_len = ftp_vfs_readlink(fullpath->s, symlink_path, sizeof(symlink_path));
+        if (symlink_len < 0) {
+            symlink_len = 0;
         }
     }
 
-    if (rc < 0) {
-        ftp_client_msg(session, 425, "Can't open data connection [NORM], %s.", strerror(errno));
-        ftp_data_transfer_end(session);
+    const char* user = ftp_vfs_getpwuid(st);
+    const char* group = ftp_vfs_getgrgid(st);
+    const size_t user_len = strlen(user);
+    const size_t group_len = strlen(group);
+    const size_t name_len = strlen(name);
+
+    // everything else is at most ~70 bytes.
+    if (user_len + group_len + name_len + symlink_len + 80 >= size) {
+        return -1;
+    }
+
+    char* p = out;
+    switch (st->st_mode & S_IFMT) {
+        case S_IFREG:   *p++ = '-'; break;
+        case S_IFDIR:   *p++ = 'd'; break;
+        case S_IFLNK:   *p++ = 'l'; break;
+        case S_IFIFO:   *p++ = 'p'; break;
+        case S_IFSOCK:  *p++ = 's'; break;
+        case S_IFCHR:   *p++ = 'c'; break;
+        case S_IFBLK:   *p++ = 'b'; break;
+        default:        *p++ = '?'; break;
+    }
+
+    for (size_t i = 0; i < FTP_ARR_SZ(bits); i++) {
+        *p++ = (st->st_mode & bits[i].mode) ? bits[i].c : '-';
+    }
+
+    *p++ = ' ';
+    p = ftp_fmt_uint_pad(p, st->st_nlink, 3);
+    *p++ = ' ';
+    memcpy(p, user, user_len);
+    p += user_len;
+    *p++ = ' ';
+    memcpy(p, group, group_len);
+    p += group_len;
+    *p++ = ' ';
+    p = ftp_fmt_uint_pad(p, S_ISDIR(st->st_mode) ? 0 : st->st_size, 13);
+
+    struct tm tm = {0};
+    ftp_list_date(session->transfer, st->st_mtime, &tm);
+    *p++ = ' ';
+    memcpy(p, months[tm.tm_mon], 3);
+    p += 3;
+    *p++ = ' ';
+    p = ftp_fmt_uint_pad(p, tm.tm_mday, 3);
+    *p++ = ' ';
+
+    // if the time is greater than 6 months, show year rather than time
+    const long long six_months = 60ll * 60ll * 24ll * (365ll / 2ll);
+    const long long age = (long long)session->last_update_time - st->st_mtime;
+    if (age > six_months || age < -six_months) {
+        p = ftp_fmt_uint_pad(p, tm.tm_year + 1900, 5);
     } else {
-        session->transfer.mode = mode;
-        session->transfer.index = 0;
-        session->transfer.connection_pending = true;
+        p = ftp_fmt_digits(p, tm.tm_hour, 2);
+        *p++ = ':';
+        p = ftp_fmt_digits(p, tm.tm_min, 2);
+    }
 
-        // try to open immediately.
-        ftp_data_poll(session);
+    *p++ = ' ';
+    memcpy(p, name, name_len);
+    p += name_len;
+    if (symlink_len) {
+        p = ftp_fmt_str(p, " -> ");
+        memcpy(p, symlink_path, symlink_len);
+        p += symlink_len;
     }
+    p = ftp_fmt_str(p, TELNET_EOL);
+    *p = '\0';
+
+    return p - out;
 }
 
-static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
-    // send as much data as possible.
+// builds the full path of an entry in the dir that is being listed.
+static int ftp_build_entry_path(const struct FtpSession* session, struct Pathname* out, const char* name) {
+    int rc;
+    if (session->temp_path.s[strlen(session->temp_path.s) - 1] != '/') {
+        rc = snprintf(out->s, sizeof(*out), "%s/%s", session->temp_path.s, name);
+    } else {
+        rc = snprintf(out->s, sizeof(*out), "%s%s", session->temp_path.s, name);
+    }
+
+    if (rc <= 0 || rc >= sizeof(*out)) {
+        return -1;
+    }
+    return 0;
+}
+
+// appends the entry to list_buf, the caller must ensure there is room for FTP_LISTENTRY_SIZE.
+// fullpath is only used to read links and may be NULL.
+static int ftp_build_list_entry(struct FtpSession* session, const struct Pathname* fullpath, const char* name, const struct stat* st) {
+    int rc;
+    struct FtpTransfer* transfer = session->transfer;
+    char* out = transfer->list_buf + transfer->size;
+
+    if (transfer->mode == FTP_TRANSFER_MODE_NLST) {
+        rc = snprintf(out, FTP_LISTENTRY_SIZE, "%s" TELNET_EOL, name);
+    } else if (transfer->mode == FTP_TRANSFER_MODE_MLSD) {
+        rc = ftp_build_mlst_entry(session, out, FTP_LISTENTRY_SIZE, name, st);
+    } else {
+        rc = ftp_build_list_line(session, out, FTP_LISTENTRY_SIZE, fullpath, name, st);
+    }
+
+    // don't send anything on error or truncated
+    if (rc <= 0 || rc >= FTP_LISTENTRY_SIZE) {
+        rc = -1;
+    } else {
+        transfer->size += rc;
+    }
+
+    return rc;
+}
+
+static void ftp_session_send(struct FtpSession* session);
+
+// returns the free space at the end of the reply queue, moving the queued replies to the front if size doesn't fit.
+static size_t ftp_client_room(struct FtpSession* session, size_t size) {
+    if (session->send_buf_offset + session->send_buf_size + size > sizeof(session->send_buf)) {
+        memmove(session->send_buf, session->send_buf + session->send_buf_offset, session->send_buf_size);
+        session->send_buf_offset = 0;
+    }
+    return sizeof(session->send_buf) - session->send_buf_offset - session->send_buf_size;
+}
+
+// queues the reply of len bytes written to the end of the queue, which must have room for TELNET_EOL.
+static void ftp_client_commit(struct FtpSession* session, unsigned code, char* msg, size_t len) {
+    // log without the EOL.
+    msg[len] = '\0';
+    if (code < 400) {
+        ftp_log_callback(FTP_API_LOG_TYPE_RESPONSE, msg);
+    } else {
+        ftp_log_callback(FTP_API_LOG_TYPE_ERROR, msg);
+    }
+
+    memcpy(msg + len, TELNET_EOL, strlen(TELNET_EOL));
+    session->send_buf_size += len + strlen(TELNET_EOL);
+
+    // whilst blocking, replies are sent once the command completes.
+    if (session->state == FTP_SESSION_STATE_BLOCKING) {
+        return;
+    }
+
+    session->state = FTP_SESSION_STATE_POLLOUT;
+    if (!session->send_deferred) {
+        ftp_session_send(session);
+    }
+}
+
+// commands are not processed unless there is room for a reply, so this only
+// happens if a single command replies multiple times to a client that doesn't read.
+static void ftp_client_drop(void) {
+    ftp_log_callback(FTP_API_LOG_TYPE_ERROR, "reply queue full, dropping reply");
+}
+
+// returns room at the end of the reply queue to build a reply of up to size bytes in,
+// including TELNET_EOL, which is then queued with ftp_client_commit(). NULL if the queue is full.
+static char* ftp_client_begin(struct FtpSession* session, size_t size) {
+    if (ftp_client_room(session, size) < size) {
+        ftp_client_drop();
+        return NULL;
+    }
+    return session->send_buf + session->send_buf_offset + session->send_buf_size;
+}
+
+// queues a constant reply, see FTP_REPLY().
+static void ftp_client_reply(struct FtpSession* session, const struct FtpReply* reply) {
+    char* msg = ftp_client_begin(session, reply->len + strlen(TELNET_EOL));
+    if (msg) {
+        memcpy(msg, reply->s, reply->len);
+        ftp_client_commit(session, reply->code, msg, reply->len);
+    }
+}
+
+// formats the reply straight into the reply queue.
+static void ftp_client_msg(struct FtpSession* session, unsigned code, const char* fmt, ...) {
+    const size_t room = ftp_client_room(session, FTP_SENDBUF_SIZE);
+    const size_t size = room < FTP_SENDBUF_SIZE ? room : FTP_SENDBUF_SIZE;
+    char* msg = session->send_buf + session->send_buf_offset + session->send_buf_size;
+
+    if (size < 64) {
+        ftp_client_drop();
+        return;
+    }
+
+    // prepend with the code.
+    char* p = ftp_fmt_uint(msg, code, 10);
+    *p++ = ' ';
+    const size_t code_len = p - msg;
+    const size_t eol_padding = code_len * 2 + 4 + 3;
+
+    // append message.
+    va_list va;
+    va_start(va, fmt);
+    int rc = vsnprintf(msg + code_len, size - eol_padding, fmt, va);
+    va_end(va);
+
+    if (rc < 0) {
+        rc = 0;
+    } else if (rc >= size - eol_padding) {
+        // only truncate replies that are too long to ever fit.
+        if (size < FTP_SENDBUF_SIZE) {
+            ftp_client_drop();
+            return;
+        }
+        rc = size - eol_padding - 1;
+    }
+
+    // if multiline message, append END.
+    size_t len = code_len + rc;
+    if (rc && msg[code_len] == '-') {
+        memmove(msg + code_len - 1, msg + code_len, rc);
+        p = ftp_fmt_uint(msg + len - 1, code, 10);
+        p = ftp_fmt_str(p, " END");
+        len = p - msg;
+    }
+
+    ftp_client_commit(session, code, msg, len);
+}
+
+static unsigned char* ftp_buf_alloc(void) {
+#if FTP_VFS_ASYNC
+    if (g_ftp_job) {
+        return malloc(FTP_FILE_BUFFER_SIZE);
+    }
+#endif
+    if (g_ftp->buf_pool_count) {
+        return g_ftp->buf_pool[--g_ftp->buf_pool_count];
+    }
+    return malloc(FTP_FILE_BUFFER_SIZE);
+}
+
+static void ftp_buf_free(unsigned char* buf) {
+#if FTP_VFS_ASYNC
+    if (g_ftp_job) {
+        free(buf);
+        return;
+    }
+#endif
+    if (g_ftp->buf_pool_count < FTP_ARR_SZ(g_ftp->buf_pool)) {
+        g_ftp->buf_pool[g_ftp->buf_pool_count++] = buf;
+    } else {
+        free(buf);
+    }
+}
+
+#if FTP_LIST_CACHE_SIZE
+static void ftp_list_cache_lock(void) {
+#if FTP_THREADS
+    pthread_mutex_lock(&g_list_cache.mutex);
+#endif
+}
+
+static void ftp_list_cache_unlock(void) {
+#if FTP_THREADS
+    pthread_mutex_unlock(&g_list_cache.mutex);
+#endif
+}
+
+// removes the entry that prev points to from the cache, must be locked.
+// if it is no longer used, it is added to garbage to be freed once unlocked.
+static void ftp_list_cache_remove(struct FtpListCacheEntry** prev, struct FtpListCacheEntry** garbage) {
+    struct FtpListCacheEntry* e = *prev;
+    *prev = e->next;
+    g_list_cache.size -= e->size;
+    if (!--e->refs) {
+        e->next = *garbage;
+        *garbage = e;
+    }
+}
+
+static void ftp_list_cache_free(struct FtpListCacheEntry* garbage) {
+    while (garbage) {
+        struct FtpListCacheEntry* next = garbage->next;
+        free(garbage);
+        garbage = next;
+    }
+}
+
+static void ftp_list_cache_key(const struct FtpSession* session, enum FTP_TRANSFER_MODE mode, struct FtpListCacheKey* key) {
+    const bool mlsd = mode == FTP_TRANSFER_MODE_MLSD;
+    const bool list = mode == FTP_TRANSFER_MODE_LIST;
+
+    key->mode = mode;
+    key->mlst_facts = mlsd ? session->mlst_facts : 0;
+    key->read_only = mlsd && g_ftp->cfg.read_only;
+    key->use_localtime = list && g_ftp->cfg.use_localtime;
+    key->day = list ? session->last_update_time / (60 * 60 * 24) : 0;
+}
+
+static bool ftp_list_cache_match(const struct FtpListCacheEntry* e, const struct FtpListCacheKey* key, const char* path) {
+    return e->key.mode == key->mode && e->key.mlst_facts == key->mlst_facts &&
+        e->key.use_localtime == key->use_localtime && e->key.read_only == key->read_only &&
+        e->key.day == key->day && !strcmp(e->path.s, path);
+}
+
+// returns the cached listing of the dir with a reference held, or NULL if there is none.
+// on a miss, gen is set so that a listing built from now on can later be cached.
+static struct FtpListCacheEntry* ftp_list_cache_get(const struct FtpSession* session, const char* path, enum FTP_TRANSFER_MODE mode, time_t mtime, unsigned* gen) {
+    struct FtpListCacheKey key;
+    ftp_list_cache_key(session, mode, &key);
+    struct FtpListCacheEntry* e;
+    struct FtpListCacheEntry* garbage = NULL;
+
+    ftp_list_cache_lock();
+    *gen = g_list_cache.gen;
+    for (struct FtpListCacheEntry** prev = &g_list_cache.head; (e = *prev); prev = &e->next) {
+        if (!ftp_list_cache_match(e, &key, path)) {
+            continue;
+        }
+
+        if (e->mtime != mtime) {
+            // changed outside of this server.
+            ftp_list_cache_remove(prev, &garbage);
+            e = NULL;
+        } else {
+            *prev = e->next;
+            e->next = g_list_cache.head;
+            g_list_cache.head = e;
+            e->refs++;
+        }
+        break;
+    }
+    ftp_list_cache_unlock();
+
+    ftp_list_cache_free(garbage);
+    return e;
+}
+
+static void ftp_list_cache_put(struct FtpListCacheEntry* e) {
+    ftp_list_cache_lock();
+    const unsigned refs = --e->refs;
+    ftp_list_cache_unlock();
+
+    if (!refs) {
+        free(e);
+    }
+}
+
+// starts recording the listing of the dir that is about to be read.
+static void ftp_list_cache_record_start(struct FtpSession* session, const char* path, enum FTP_TRANSFER_MODE mode, time_t mtime, unsigned gen) {
+    struct FtpListCacheEntry* e = calloc(1, sizeof(*e));
+    if (e) {
+        e->gen = gen;
+        ftp_list_cache_key(session, mode, &e->key);
+        e->mtime = mtime;
+        strcpy(e->path.s, path);
+        session->transfer->list_record = e;
+    }
+}
+
+static void ftp_list_cache_record_drop(struct FtpTransfer* transfer) {
+    struct FtpListCacheEntry* e = transfer->list_record;
+    if (e) {
+        ftp_list_cache_lock();
+        g_list_cache.recording -= e->capacity;
+        ftp_list_cache_unlock();
+
+        free(e);
+        transfer->list_record = NULL;
+    }
+}
+
+// appends to the listing being recorded, which is dropped if it grows too large to cache.
+static void ftp_list_cache_record(struct FtpTransfer* transfer, const char* data, size_t size) {
+    struct FtpListCacheEntry* e = transfer->list_record;
+    if (!e) {
+        return;
+    }
+
+    if (e->size + size > e->capacity) {
+        size_t capacity = e->capacity ? e->capacity : FTP_LISTBUF_SIZE;
+        while (capacity < e->size + size) {
+            capacity *= 2;
+        }
+        if (capacity > FTP_LIST_CACHE_ENTRY_SIZE) {
+            capacity = FTP_LIST_CACHE_ENTRY_SIZE;
+        }
+
+        // reserve the growth so that concurrent listings can't exhaust memory.
+        bool reserved = false;
+        if (e->size + size <= capacity) {
+            ftp_list_cache_lock();
+            if (g_list_cache.recording + capacity - e->capacity <= FTP_LIST_CACHE_SIZE) {
+                g_list_cache.recording += capacity - e->capacity;
+                reserved = true;
+            }
+            ftp_list_cache_unlock();
+        }
+
+        struct FtpListCacheEntry* n = NULL;
+        if (reserved) {
+            n = realloc(e, sizeof(*e) + capacity);
+            if (!n) {
+                ftp_list_cache_lock();
+                g_list_cache.recording -= capacity - e->capacity;
+                ftp_list_cache_unlock();
+            }
+        }
+
+        if (!n) {
+            ftp_list_cache_record_drop(transfer);
+            return;
+        }
+
+        e = transfer->list_record = n;
+        e->capacity = capacity;
+    }
+
+    memcpy(e->data + e->size, data, size);
+    e->size += size;
+}
+
+// caches the recorded listing, unless a write invalidated listings since the dir was opened.
+// must only be called once the whole dir has been read.
+static void ftp_list_cache_record_end(struct FtpTransfer* transfer) {
+    struct FtpListCacheEntry* e = transfer->list_record;
+    if (!e) {
+        return;
+    }
+
+    transfer->list_record = NULL;
+    struct FtpListCacheEntry* garbage = NULL;
+    ftp_list_cache_lock();
+    g_list_cache.recording -= e->capacity;
+
+    if (e->gen != g_list_cache.gen) {
+        e->next = garbage;
+        garbage = e;
+    } else {
+        // another session may have cached the same listing in the meantime.
+        struct FtpListCacheEntry** prev = &g_list_cache.head;
+        while (*prev) {
+            if (ftp_list_cache_match(*prev, &e->key, e->path.s)) {
+                ftp_list_cache_remove(prev, &garbage);
+            } else {
+                prev = &(*prev)->next;
+            }
+        }
+
+        e->refs = 1;
+        e->next = g_list_cache.head;
+        g_list_cache.head = e;
+        g_list_cache.size += e->size;
+
+        // evict the least recently used listings.
+        while (g_list_cache.size > FTP_LIST_CACHE_SIZE) {
+            prev = &g_list_cache.head;
+            while ((*prev)->next) {
+                prev = &(*prev)->next;
+            }
+            ftp_list_cache_remove(prev, &garbage);
+        }
+    }
+
+    ftp_list_cache_unlock();
+    ftp_list_cache_free(garbage);
+}
+
+static void ftp_list_cache_attach(void) {
+    ftp_list_cache_lock();
+    g_list_cache.servers++;
+    ftp_list_cache_unlock();
+}
+
+static void ftp_list_cache_detach(void) {
+    struct FtpListCacheEntry* garbage = NULL;
+    ftp_list_cache_lock();
+    if (!--g_list_cache.servers) {
+        while (g_list_cache.head) {
+            ftp_list_cache_remove(&g_list_cache.head, &garbage);
+        }
+    }
+    ftp_list_cache_unlock();
+    ftp_list_cache_free(garbage);
+}
+#endif
+
+// drops the cached listings that a write to path may have changed,
+// which are the listing of its parent and of path and below if it is a dir.
+static void ftp_list_cache_invalidate(const char* path) {
+#if FTP_LIST_CACHE_SIZE
+    const size_t len = strlen(path);
+    const char* slash = strrchr(path, '/');
+    size_t parent_len = 0;
+    if (slash) {
+        parent_len = slash == path ? 1 : slash - path;
+    }
+
+    struct FtpListCacheEntry* garbage = NULL;
+    ftp_list_cache_lock();
+    g_list_cache.gen++;
+
+    struct FtpListCacheEntry** prev = &g_list_cache.head;
+    while (*prev) {
+        const char* s = (*prev)->path.s;
+        if ((strlen(s) == parent_len && !strncmp(s, path, parent_len)) || (!strncmp(s, path, len) && (s[len] == '\0' || s[len] == '/'))) {
+            ftp_list_cache_remove(prev, &garbage);
+        } else {
+            prev = &(*prev)->next;
+        }
+    }
+
+    ftp_list_cache_unlock();
+    ftp_list_cache_free(garbage);
+#endif
+}
+
+// returns the transfer state, allocating it if needed.
+static struct FtpTransfer* ftp_transfer_alloc(struct FtpSession* session) {
+    if (!session->transfer) {
+        session->transfer = calloc(1, sizeof(*session->transfer));
+    }
+    return session->transfer;
+}
+
+static void ftp_transfer_free(struct FtpSession* session) {
+    if (session->transfer) {
+        ftp_vfs_close(&session->transfer->file_vfs);
+        ftp_vfs_closedir(&session->transfer->dir_vfs);
+        if (session->transfer->buf) {
+            ftp_buf_free(session->transfer->buf);
+        }
+#if FTP_LIST_CACHE_SIZE
+        if (session->transfer->list_cached) {
+            ftp_list_cache_put(session->transfer->list_cached);
+        }
+        ftp_list_cache_record_drop(session->transfer);
+#endif
+        free(session->transfer);
+        session->transfer = NULL;
+    }
+}
+
+static void ftp_data_transfer_end(struct FtpSession* session) {
+    switch (session->data_connection) {
+        case FTP_DATA_CONNECTION_NONE:
+            break;
+        case FTP_DATA_CONNECTION_ACTIVE:
+            ftp_socket_close(&session->data_sock);
+            break;
+        case FTP_DATA_CONNECTION_PASSIVE:
+            ftp_socket_close(&session->data_sock);
+            ftp_socket_close(&session->pasv_sock);
+            break;
+    }
+
+#if FTP_LIST_CACHE_SIZE
+    // the size of the file is only final once the upload ends.
+    if (session->transfer && session->transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        ftp_list_cache_invalidate(session->transfer->upload_path.s);
+    }
+#endif
+
+    ftp_transfer_free(session);
+
+#if FTP_SOCKET_POLL_SET
+    // closing the socket removes it from the poll set.
+    session->poll_data_sock = NULL;
+    session->poll_data_events = 0;
+#endif
+
+    // a worker must not touch the timer heap, the session is requeued once the command completes.
+    if (session->data_deadline) {
+        session->data_deadline = 0;
+        if (session->state != FTP_SESSION_STATE_BLOCKING && session->timer_slot) {
+            ftp_timer_sift(session->timer_slot - 1);
+        }
+    }
+
+    session->temp_path.s[0] = '\0';
+    session->data_connection = FTP_DATA_CONNECTION_NONE;
+}
+
+static void ftp_data_poll(struct FtpSession* session) {
+    int rc = 0;
+
+    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
+        rc = ftp_socket_connect(&session->data_sock, (struct sockaddr*)&session->data_sockaddr, sizeof(session->data_sockaddr));
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EINPROGRESS || errno == EALREADY) {
+                // blocking...
+            } else if (errno == EISCONN) {
+                session->transfer->connection_pending = false;
+            } else {
+                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+        } else {
+            session->transfer->connection_pending = false;
+        }
+    } else {
+        size_t socklen = sizeof(session->pasv_sockaddr);
+        rc = ftp_socket_accept(&session->data_sock, &session->pasv_sock, (struct sockaddr*)&session->pasv_sockaddr, &socklen);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // blocking...
+            } else {
+                ftp_client_msg(session, 425, "Can't open data connection, [poll] %d %s.", errno, strerror(errno));
+                ftp_data_transfer_end(session);
+            }
+        } else {
+            ftp_set_data_socket_options(&session->data_sock);
+            session->transfer->connection_pending = false;
+        }
+    }
+}
+
+static void ftp_data_open(struct FtpSession* session, enum FTP_TRANSFER_MODE mode) {
+    int rc = 0;
+    ftp_client_reply(session, FTP_REPLY(150, "File status okay; about to open data connection."));
+
+    if (session->data_connection == FTP_DATA_CONNECTION_ACTIVE) {
+        rc = ftp_socket_open(&session->data_sock, PF_INET, SOCK_STREAM, 0);
+        if (rc >= 0) {
+            ftp_set_data_socket_options(&session->data_sock);
+        }
+    }
+
+    if (rc < 0) {
+        ftp_client_msg(session, 425, "Can't open data connection [NORM], %s.", strerror(errno));
+        ftp_data_transfer_end(session);
+    } else {
+        session->transfer->mode = mode;
+        session->transfer->index = 0;
+        session->transfer->connection_pending = true;
+        ftp_update_transfer_time(session);
+
+        // try to open immediately.
+        ftp_data_poll(session);
+    }
+}
+
+// returns the next entry of the dir that is being listed, NULL once all have been read
+// or on error, errno is 0 at the end of the dir.
+static const char* ftp_dir_read(struct FtpTransfer* transfer, const struct FtpVfsDirEntry** entry) {
+#if FTP_VFS_READDIR_BATCH
+    if (transfer->dir_index == transfer->dir_count) {
+        const int n = ftp_vfs_readdir_batch(&transfer->dir_vfs, transfer->dir_entries, transfer->dir_names, FTP_ARR_SZ(transfer->dir_entries));
+        if (n <= 0) {
+            if (!n) {
+                errno = 0;
+            }
+            return NULL;
+        }
+
+        transfer->dir_index = 0;
+        transfer->dir_count = n;
+    }
+
+    *entry = &transfer->dir_entries[transfer->dir_index];
+    return transfer->dir_names[transfer->dir_index++];
+#else
+    static FTP_THREAD_LOCAL struct FtpVfsDirEntry dir_entry;
+    *entry = &dir_entry;
+    errno = 0;
+    return ftp_vfs_readdir(&transfer->dir_vfs, &dir_entry);
+#endif
+}
+
+static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSession* session, struct FtpTransfer* transfer) {
+    const char* data = transfer->list_buf;
+#if FTP_LIST_CACHE_SIZE
+    // a cached listing is sent as is, the dir is never opened.
+    if (transfer->list_cached) {
+        if (!transfer->size) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
+        data = transfer->list_cached->data;
+    }
+#endif
+
+    // send as much data as possible.
     if (transfer->size) {
-        const int n = ftp_socket_send(&session->data_sock, transfer->list_buf + transfer->offset, transfer->size, 0);
+        const int n = ftp_socket_send(&session->data_sock, data + transfer->offset, transfer->size, 0);
         if (n < 0) {
             // check if it failed due to anything but blocking.
             if (errno != EWOULDBLOCK && errno != EAGAIN) {
@@ -530,9 +1558,10 @@ static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSes
             // partial transfer.
             transfer->offset += n;
             transfer->size -= n;
+            transfer->deficit -= n;
             return FTP_FILE_TRANSFER_STATE_BLOCKING;
         } else {
-            transfer->list_buf[0] = '\0';
+            transfer->deficit -= n;
             transfer->offset = 0;
             transfer->size = 0;
 
@@ -542,36 +1571,66 @@ static enum FTP_FILE_TRANSFER_STATE ftp_dir_data_transfer_progress(struct FtpSes
             }
         }
     } else {
-        // parse the next file.
-        static struct FtpVfsDirEntry entry;
-        const char* name = ftp_vfs_readdir(&transfer->dir_vfs, &entry);
-        if (!name) {
-            return FTP_FILE_TRANSFER_STATE_FINISHED;
-        }
+        // fill the buffer with as many entries as fit.
+        while (sizeof(transfer->list_buf) - transfer->size >= FTP_LISTENTRY_SIZE) {
+            const struct FtpVfsDirEntry* entry;
+            const char* name = ftp_dir_read(transfer, &entry);
+            if (!name) {
+#if FTP_LIST_CACHE_SIZE
+                // a listing cut short by an error is sent but not cached.
+                if (errno) {
+                    ftp_list_cache_record_drop(transfer);
+                }
+#endif
+                // send what is left, the transfer finishes once the dir is closed.
+                ftp_vfs_closedir(&transfer->dir_vfs);
+                break;
+            }
 
-        if (!strcmp(".", name) || !strcmp("..", name)) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
-        }
+            if (!strcmp(".", name) || !strcmp("..", name)) {
+                continue;
+            }
 
-        int rc;
-        struct Pathname filepath;
-        if (session->temp_path.s[strlen(session->temp_path.s) - 1] != '/') {
-            rc = snprintf(filepath.s, sizeof(filepath), "%s/%s", session->temp_path.s, name);
-        } else {
-            rc = snprintf(filepath.s, sizeof(filepath), "%s%s", session->temp_path.s, name);
-        }
+            struct Pathname filepath;
+            const struct Pathname* path = NULL;
+            struct stat st = {0};
+
+            // NLST only lists the names.
+            if (transfer->mode != FTP_TRANSFER_MODE_NLST) {
+#if FTP_VFS_DIRLSTAT_AT
+                if (ftp_vfs_dirlstat(&transfer->dir_vfs, entry, NULL, &st) < 0) {
+                    continue;
+                }
+
+                // the full path is only needed to read the link.
+                if (S_ISLNK(st.st_mode) && transfer->mode == FTP_TRANSFER_MODE_LIST && !ftp_build_entry_path(session, &filepath, name)) {
+                    path = &filepath;
+                }
+#else
+                if (ftp_build_entry_path(session, &filepath, name) < 0) {
+                    continue;
+                }
+
+                path = &filepath;
+                if (ftp_vfs_dirlstat(&transfer->dir_vfs, entry, path->s, &st) < 0) {
+                    continue;
+                }
+#endif
+            }
 
-        if (rc <= 0 || rc >= sizeof(filepath)) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+            ftp_build_list_entry(session, path, name, &st);
         }
 
-        struct stat st = {0};
-        rc = ftp_vfs_dirlstat(&transfer->dir_vfs, &entry, filepath.s, &st);
-        if (rc < 0) {
-            return FTP_FILE_TRANSFER_STATE_CONTINUE;
+#if FTP_LIST_CACHE_SIZE
+        ftp_list_cache_record(transfer, transfer->list_buf, transfer->size);
+        if (!ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+            ftp_list_cache_record_end(transfer);
         }
+#endif
 
-        ftp_build_list_entry(session, &filepath, name, &st);
+        if (!transfer->size && !ftp_vfs_isdir_open(&transfer->dir_vfs)) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
     }
 
     return FTP_FILE_TRANSFER_STATE_CONTINUE;
@@ -581,30 +1640,92 @@ static enum FTP_FILE_TRANSFER_STATE ftp_file_data_transfer_progress(struct FtpSe
     int n;
 
     if (transfer->mode == FTP_TRANSFER_MODE_RETR) {
-        const int read = n = ftp_vfs_read(&transfer->file_vfs, g_ftp.data_buf, sizeof(g_ftp.data_buf));
+#if FTP_VFS_SENDFILE
+        n = ftp_vfs_sendfile(&transfer->file_vfs, &session->data_sock, transfer->buf, FTP_FILE_BUFFER_SIZE, transfer->offset);
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            } else {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
+        } else if (n == 0) {
+            return FTP_FILE_TRANSFER_STATE_FINISHED;
+        } else {
+            transfer->offset += (size_t)n;
+            transfer->deficit -= n;
+            if (n % (FTP_FILE_BUFFER_SIZE)) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            }
+        }
+#elif FTP_VFS_SPAN
+        // send straight from the vfs, no copy into the transfer buffer.
+        const void* span;
+        n = ftp_vfs_span(&transfer->file_vfs, transfer->offset, &span);
         if (n < 0) {
             return FTP_FILE_TRANSFER_STATE_ERROR;
         } else if (n == 0) {
             return FTP_FILE_TRANSFER_STATE_FINISHED;
+        }
+
+        // don't send more than what is left of the quantum.
+        size_t len = n;
+        if (len > (unsigned long long)transfer->deficit) {
+            len = transfer->deficit;
+        }
+
+        n = ftp_socket_send(&session->data_sock, span, len, 0);
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            } else {
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
         } else {
-            n = ftp_socket_send(&session->data_sock, g_ftp.data_buf, n, 0);
+            transfer->offset += (size_t)n;
+            transfer->deficit -= n;
+            if ((size_t)n != len) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
+            }
+        }
+#else
+        // only read more once everything in the buffer has been sent.
+        if (transfer->buf_offset == transfer->buf_size) {
+            n = ftp_vfs_read(&transfer->file_vfs, transfer->buf, FTP_FILE_BUFFER_SIZE);
             if (n < 0) {
-                if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                    ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, 0, transfer->offset);
-                    return FTP_FILE_TRANSFER_STATE_BLOCKING;
-                } else {
-                    return FTP_FILE_TRANSFER_STATE_ERROR;
-                }
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            } else if (n == 0) {
+                return FTP_FILE_TRANSFER_STATE_FINISHED;
+            }
+            transfer->buf_offset = 0;
+            transfer->buf_size = n;
+        }
+
+        // don't send more than what is left of the quantum.
+        size_t len = transfer->buf_size - transfer->buf_offset;
+        if (len > (unsigned long long)transfer->deficit) {
+            len = transfer->deficit;
+        }
+
+        n = ftp_socket_send(&session->data_sock, transfer->buf + transfer->buf_offset, len, 0);
+        if (n < 0) {
+            if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
             } else {
-                transfer->offset += (size_t)n;
-                if (n != read) {
-                    ftp_vfs_seek(&transfer->file_vfs, g_ftp.data_buf, n, transfer->offset);
-                    return FTP_FILE_TRANSFER_STATE_BLOCKING;
-                }
+                return FTP_FILE_TRANSFER_STATE_ERROR;
+            }
+        } else {
+            transfer->offset += (size_t)n;
+            transfer->buf_offset += (size_t)n;
+            transfer->deficit -= n;
+            // partial send, the rest is kept for the next call.
+            if ((size_t)n != len) {
+                return FTP_FILE_TRANSFER_STATE_BLOCKING;
             }
         }
+#endif
     } else {
-        n = ftp_socket_recv(&session->data_sock, g_ftp.data_buf, sizeof(g_ftp.data_buf), 0);
+#if FTP_VFS_RECVFILE
+        n = ftp_vfs_recvfile(&transfer->file_vfs, &session->data_sock, transfer->buf, FTP_FILE_BUFFER_SIZE);
         if (n < 0) {
             if (errno == EWOULDBLOCK || errno == EAGAIN) {
                 return FTP_FILE_TRANSFER_STATE_BLOCKING;
@@ -614,49 +1735,78 @@ static enum FTP_FILE_TRANSFER_STATE ftp_file_data_transfer_progress(struct FtpSe
         } else if (n == 0) {
             return FTP_FILE_TRANSFER_STATE_FINISHED;
         } else {
-            n = ftp_vfs_write(&transfer->file_vfs, g_ftp.data_buf, n);
+            transfer->offset += n;
+            transfer->deficit -= n;
+        }
+#else
+        // only recv more once everything in the buffer has been written.
+        if (transfer->buf_offset == transfer->buf_size) {
+            size_t len = FTP_FILE_BUFFER_SIZE;
+            if (len > (unsigned long long)transfer->deficit) {
+                len = transfer->deficit;
+            }
+
+            n = ftp_socket_recv(&session->data_sock, transfer->buf, len, 0);
             if (n < 0) {
-                return FTP_FILE_TRANSFER_STATE_ERROR;
-            } else {
-                transfer->offset += n;
+                if (errno == EWOULDBLOCK || errno == EAGAIN) {
+                    return FTP_FILE_TRANSFER_STATE_BLOCKING;
+                } else {
+                    return FTP_FILE_TRANSFER_STATE_ERROR;
+                }
+            } else if (n == 0) {
+                return FTP_FILE_TRANSFER_STATE_FINISHED;
             }
+            transfer->buf_offset = 0;
+            transfer->buf_size = n;
+            transfer->deficit -= n;
+        }
+
+        n = ftp_vfs_write(&transfer->file_vfs, transfer->buf + transfer->buf_offset, transfer->buf_size - transfer->buf_offset);
+        if (n < 0) {
+            return FTP_FILE_TRANSFER_STATE_ERROR;
+        } else {
+            transfer->offset += (size_t)n;
+            transfer->buf_offset += (size_t)n;
         }
+#endif
     }
 
     return FTP_FILE_TRANSFER_STATE_CONTINUE;
 }
 
 static void ftp_data_transfer_progress(struct FtpSession* session) {
-    struct FtpTransfer* transfer = &session->transfer;
+    struct FtpTransfer* transfer = session->transfer;
     enum FTP_FILE_TRANSFER_STATE state = FTP_FILE_TRANSFER_STATE_CONTINUE;
-    const size_t start = ftp_get_timestamp_ms();
 
-    while (state == FTP_FILE_TRANSFER_STATE_CONTINUE) {
+    // deficit round robin, each time the transfer is ready it is given another quantum.
+    transfer->deficit += (long long)g_ftp->transfer_quantum * session->weight;
+
+    while (state == FTP_FILE_TRANSFER_STATE_CONTINUE && transfer->deficit > 0) {
         if (transfer->mode == FTP_TRANSFER_MODE_RETR || transfer->mode == FTP_TRANSFER_MODE_STOR) {
             state = ftp_file_data_transfer_progress(session, transfer);
         } else {
             state = ftp_dir_data_transfer_progress(session, transfer);
         }
 
-        if (g_ftp.cfg.progress_callback) {
-            g_ftp.cfg.progress_callback();
+        if (g_ftp->cfg.progress_callback) {
+            g_ftp->cfg.progress_callback();
         }
+    }
 
-        // break out if 1ms has elapsed as to not block for too long.
-        if (ftp_get_timestamp_ms() - start >= 1) {
-            break;
-        }
+    // an unused quantum is not carried over once the transfer would block.
+    if (state != FTP_FILE_TRANSFER_STATE_CONTINUE && transfer->deficit > 0) {
+        transfer->deficit = 0;
     }
 
     if (state == FTP_FILE_TRANSFER_STATE_ERROR) {
         ftp_client_msg(session, 426, "Connection closed; transfer aborted, %s", strerror(errno));
         ftp_data_transfer_end(session);
     } else if (state == FTP_FILE_TRANSFER_STATE_FINISHED) {
-        ftp_client_msg(session, 226, "Closing data connection.");
+        ftp_client_reply(session, FTP_REPLY(226, "Closing data connection."));
         ftp_data_transfer_end(session);
     }
 
-    ftp_update_session_time(session);
+    ftp_update_transfer_time(session);
 }
 
 // USER <SP> <username> <CRLF> | 230, 530, 500, 501, 421, 331, 332
@@ -665,19 +1815,19 @@ static void ftp_cmd_USER(struct FtpSession* session, const char* data) {
     int rc = snprintf(username, sizeof(username), "%s", data);
 
     if (rc <= 0 || rc >= sizeof(username)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
-    } else if (g_ftp.cfg.anon) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
+    } else if (g_ftp->cfg.anon) {
         if (strcmp(username, "anonymous")) {
-            ftp_client_msg(session, 530, "Not logged in.");
+            ftp_client_reply(session, FTP_REPLY(530, "Not logged in."));
         } else {
             session->auth_mode = FTP_AUTH_MODE_VALID;
-            ftp_client_msg(session, 230, "User logged in, proceed.");
+            ftp_client_reply(session, FTP_REPLY(230, "User logged in, proceed."));
         }
-    } else if (strcmp(username, g_ftp.cfg.user)) {
-        ftp_client_msg(session, 530, "Not logged in.");
+    } else if (strcmp(username, g_ftp->cfg.user)) {
+        ftp_client_reply(session, FTP_REPLY(530, "Not logged in."));
     } else {
         session->auth_mode = FTP_AUTH_MODE_NEED_PASS;
-        ftp_client_msg(session, 331, "User name okay, need password.");
+        ftp_client_reply(session, FTP_REPLY(331, "User name okay, need password."));
     }
 }
 
@@ -687,80 +1837,75 @@ static void ftp_cmd_PASS(struct FtpSession* session, const char* data) {
     int rc = snprintf(password, sizeof(password), "%s", data);
 
     if (rc <= 0 || rc >= sizeof(password)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else if (session->auth_mode != FTP_AUTH_MODE_NEED_PASS) {
-        ftp_client_msg(session, 503, "Bad sequence of commands.");
-    } else if (strcmp(password, g_ftp.cfg.pass)) {
-        ftp_client_msg(session, 530, "Not logged in.");
+        ftp_client_reply(session, FTP_REPLY(503, "Bad sequence of commands."));
+    } else if (strcmp(password, g_ftp->cfg.pass)) {
+        ftp_client_reply(session, FTP_REPLY(530, "Not logged in."));
     } else {
         session->auth_mode = FTP_AUTH_MODE_VALID;
-        ftp_client_msg(session, 230, "User logged in, proceed.");
+        ftp_client_reply(session, FTP_REPLY(230, "User logged in, proceed."));
     }
 }
 
 // ACCT <SP> <account-information> <CRLF> | 230, 202, 530, 500, 501, 503, 421
 static void ftp_cmd_ACCT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+    ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
 }
 
 // used by CDUP and CWD
-static void ftp_set_directory(struct FtpSession* session, const struct Pathname* pathname) {
-    struct Pathname fullpath = {0};
-    int rc = build_fullpath(session, &fullpath, *pathname);
+static void ftp_set_directory(struct FtpSession* session, const char* path) {
+    struct Pathname fullpath;
+    int rc = build_fullpath(session, &fullpath, path);
 
-    if (rc >= 0) {
-        if (strcmp("/", fullpath.s)) {
-            struct stat st = {0};
-            rc = ftp_vfs_stat(fullpath.s, &st);
-            if (!S_ISDIR(st.st_mode)) {
-                errno = ENOTDIR;
-                rc = -1;
-            }
+    if (rc > 0) {
+        struct stat st = {0};
+        rc = ftp_vfs_stat(fullpath.s, &st);
+        if (!S_ISDIR(st.st_mode)) {
+            errno = ENOTDIR;
+            rc = -1;
         }
     }
 
     if (rc < 0) {
         ftp_client_msg(session, 550, "Requested action not taken, %s. Bad path: %s.", strerror(errno), fullpath.s);
     } else {
-        session->pwd = fullpath;
-        ftp_client_msg(session, 200, "Command okay.");
+        strcpy(session->pwd.s, fullpath.s);
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     }
 }
 
 // CWD <SP> <pathname> <CRLF> | 250, 500, 501, 502, 421, 530, 550
 static void ftp_cmd_CWD(struct FtpSession* session, const char* data) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
-
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        ftp_set_directory(session, &pathname);
+        ftp_set_directory(session, data);
     }
 }
 
 // CDUP <SP> <pathname> <CRLF> | 250, 500, 501, 502, 421, 530, 550
 static void ftp_cmd_CDUP(struct FtpSession* session, const char* data) {
     if (!strcmp("/", session->pwd.s)) {
-        ftp_client_msg(session, 550, "Requested action not taken.");
+        ftp_client_reply(session, FTP_REPLY(550, "Requested action not taken."));
     } else {
-        ftp_set_directory(session, &(const struct Pathname){".."});
+        ftp_set_directory(session, "..");
     }
 }
 
 // SMNT <SP> <> <CRLF> | 202, 250, 500, 501, 502, 421, 530, 550
 static void ftp_cmd_SMNT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+    ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
 }
 
 // REIN <CRLF> | 120, 220, 220, 421, 500, 502
 static void ftp_cmd_REIN(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+    ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
 }
 
 // QUIT <SP> <password> <CRLF> | 221, 500
 static void ftp_cmd_QUIT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 221, "Service closing control connection.");
+    ftp_client_reply(session, FTP_REPLY(221, "Service closing control connection."));
 }
 
 // PORT <SP> <host-port> <CRLF> | 200, 500, 501, 421, 530
@@ -772,7 +1917,7 @@ static void ftp_cmd_PORT(struct FtpSession* session, const char* data) {
         char* end_ptr;
         const unsigned long value = strtoul(data, &end_ptr, 10);
         if ((!value && data == end_ptr) || value > 255) {
-            ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+            ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
             return;
         }
 
@@ -797,7 +1942,7 @@ static void ftp_cmd_PORT(struct FtpSession* session, const char* data) {
             session->data_sockaddr.sin_family = PF_INET;
             session->data_sockaddr.sin_port = htons((h[4] << 8) + h[5]);
             session->data_connection = FTP_DATA_CONNECTION_ACTIVE;
-            ftp_client_msg(session, 200, "Command okay.");
+            ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
         }
     }
 }
@@ -829,18 +1974,24 @@ static void ftp_cmd_PASV(struct FtpSession* session, const char* data) {
                 if (rc < 0) {
                     ftp_client_msg(session, 501, "socket_getsockname failed Syntax error in parameters or arguments, %s.", strerror(errno));
                 } else {
-                    char ip_buf[16] = {0};
-                    const char* addr_s = inet_ntoa(session->control_sockaddr.sin_addr);
-                    for (int i = 0; addr_s[i]; i++) {
-                        ip_buf[i] = addr_s[i];
-                        if (ip_buf[i] == '.') {
-                            ip_buf[i] = ',';
-                        }
-                    }
-
                     const unsigned port = ntohs(session->pasv_sockaddr.sin_port);
                     session->data_connection = FTP_DATA_CONNECTION_PASSIVE;
-                    ftp_client_msg(session, 227, "Entering Passive Mode (%s,%u,%u)", ip_buf, port >> 8, port & 0xFF);
+
+                    char* msg = ftp_client_begin(session, 64);
+                    if (msg) {
+                        // the address is in network order, so the bytes are already in the order they are sent.
+                        const unsigned char* ip = (const unsigned char*)&session->control_sockaddr.sin_addr.s_addr;
+                        char* p = ftp_fmt_str(msg, "227 Entering Passive Mode (");
+                        for (int i = 0; i < 4; i++) {
+                            p = ftp_fmt_uint(p, ip[i], 10);
+                            *p++ = ',';
+                        }
+                        p = ftp_fmt_uint(p, port >> 8, 10);
+                        *p++ = ',';
+                        p = ftp_fmt_uint(p, port & 0xFF, 10);
+                        *p++ = ')';
+                        ftp_client_commit(session, 227, msg, p - msg);
+                    }
                     return;
                 }
             }
@@ -854,15 +2005,15 @@ static void ftp_cmd_TYPE(struct FtpSession* session, const char* data) {
     const char code = data[0];
 
     if (code == '\0') {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else if (code == 'A') {
         session->type = FTP_TYPE_ASCII;
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else if (code == 'I') {
         session->type = FTP_TYPE_IMAGE;
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else {
-        ftp_client_msg(session, 504, "Command not implemented for that parameter.");
+        ftp_client_reply(session, FTP_REPLY(504, "Command not implemented for that parameter."));
     }
 }
 
@@ -871,12 +2022,12 @@ static void ftp_cmd_STRU(struct FtpSession* session, const char* data) {
     const char code = data[0];
 
     if (code == '\0') {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else if (code == 'F') {
         session->structure = FTP_STRUCTURE_FILE;
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else {
-        ftp_client_msg(session, 504, "Command not implemented for that parameter.");
+        ftp_client_reply(session, FTP_REPLY(504, "Command not implemented for that parameter."));
     }
 }
 
@@ -885,50 +2036,72 @@ static void ftp_cmd_MODE(struct FtpSession* session, const char* data) {
     const char code = data[0];
 
     if (code == '\0') {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else if (code == 'S') {
         session->mode = FTP_MODE_STREAM;
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else {
-        ftp_client_msg(session, 504, "Command not implemented for that parameter.");
+        ftp_client_reply(session, FTP_REPLY(504, "Command not implemented for that parameter."));
     }
 }
 
 static void ftp_open_file(struct FtpSession* session, const char* data, enum FtpVfsOpenMode open_mode, enum FTP_TRANSFER_MODE transfer_mode, int error_code) {
-    session->transfer.offset = 0;
+    if (!ftp_transfer_alloc(session)) {
+        ftp_client_reply(session, FTP_REPLY(451, "Requested action aborted: local error in processing, out of memory."));
+        return;
+    }
+
+    session->transfer->offset = 0;
     if (session->server_marker > 0) {
-        session->transfer.offset = session->server_marker;
+        session->transfer->offset = session->server_marker;
         session->server_marker = 0;
     }
 
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        struct Pathname fullpath = {0};
-        rc = build_fullpath(session, &fullpath, pathname);
+        struct Pathname fullpath;
+        rc = build_fullpath(session, &fullpath, data);
         if (rc < 0) {
             ftp_client_msg(session, error_code, "Requested action not taken.");
         } else {
-            rc = ftp_vfs_open(&session->transfer.file_vfs, fullpath.s, open_mode);
+            rc = ftp_vfs_open(&session->transfer->file_vfs, fullpath.s, open_mode);
             if (rc < 0) {
                 ftp_client_msg(session, error_code, "Requested action not taken, %s Failed to open path: %s.", strerror(errno), fullpath.s);
             } else {
-                if (session->transfer.offset) {
-                    rc = ftp_vfs_seek(&session->transfer.file_vfs, NULL, 0, session->transfer.offset);
+                if (transfer_mode == FTP_TRANSFER_MODE_STOR) {
+                    ftp_list_cache_invalidate(fullpath.s);
+                }
+
+                if (session->transfer->offset) {
+                    rc = ftp_vfs_seek(&session->transfer->file_vfs, NULL, 0, session->transfer->offset);
                 }
 
                 if (rc < 0) {
-                    ftp_vfs_close(&session->transfer.file_vfs);
+                    ftp_vfs_close(&session->transfer->file_vfs);
                     ftp_client_msg(session, 550, "Requested action not taken, %s. Failed to fseek path: %s", strerror(errno), fullpath.s);
+                } else if (!session->transfer->buf && !(session->transfer->buf = ftp_buf_alloc())) {
+                    ftp_vfs_close(&session->transfer->file_vfs);
+                    ftp_client_reply(session, FTP_REPLY(451, "Requested action aborted: local error in processing, out of memory."));
                 } else {
+#if FTP_LIST_CACHE_SIZE
+                    if (transfer_mode == FTP_TRANSFER_MODE_STOR) {
+                        // the listing is invalidated again once the upload ends.
+                        session->transfer->upload_path = fullpath;
+                    }
+#endif
                     ftp_data_open(session, transfer_mode);
                 }
             }
         }
     }
+
+    // only keep the transfer state around if the transfer was started.
+    if (session->transfer && session->transfer->mode == FTP_TRANSFER_MODE_NONE) {
+        ftp_transfer_free(session);
+    }
 }
 
 // RETR <SP> <pathname> <CRLF> | 125, 150, (110), 226, 250, 425, 426, 451, 450, 550, 500, 501, 421, 530
@@ -948,7 +2121,7 @@ static void ftp_cmd_APPE(struct FtpSession* session, const char* data) {
 
 // ALLO <SP> <decimal-integer> <CRLF> | 200, 202, 500, 501, 504, 421, 530
 static void ftp_cmd_ALLO(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 200, "Command okay.");
+    ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
 }
 
 // REST <SP> <marker> <CRLF> | 500, 501, 502, 421, 530, 350
@@ -957,43 +2130,41 @@ static void ftp_cmd_REST(struct FtpSession* session, const char* data) {
     const long server_marker = strtol(data, &end_ptr, 10);
 
     if ((!server_marker && data == end_ptr) || server_marker < 0) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
         session->server_marker = server_marker;
-        ftp_client_msg(session, 350, "Requested file action pending further information.");
+        ftp_client_reply(session, FTP_REPLY(350, "Requested file action pending further information."));
     }
 }
 
 // RNFR <SP> <pathname> <CRLF> | 450, 550, 500, 501, 502, 421, 530, 350
 static void ftp_cmd_RNFR(struct FtpSession* session, const char* data) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        rc = build_fullpath(session, &session->temp_path, pathname);
+        rc = build_fullpath(session, &session->temp_path, data);
         if (rc < 0) {
             ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
         } else {
-            ftp_client_msg(session, 350, "Requested file action pending further information.");
+            ftp_client_reply(session, FTP_REPLY(350, "Requested file action pending further information."));
         }
     }
 }
 
 // RNTO <SP> <pathname> <CRLF> | 250, 532, 553, 500, 501, 502, 503, 421, 530
 static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
         if (session->temp_path.s[0] == '\0') {
-            ftp_client_msg(session, 503, "Bad sequence of commands.");
+            ftp_client_reply(session, FTP_REPLY(503, "Bad sequence of commands."));
         } else {
             struct Pathname dst_path;
-            rc = build_fullpath(session, &dst_path, pathname);
+            rc = build_fullpath(session, &dst_path, data);
             if (rc < 0) {
                 ftp_client_msg(session, 553, "Requested action not taken, %s.", strerror(errno));
             } else {
@@ -1001,7 +2172,9 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
                 if (rc < 0) {
                     ftp_client_msg(session, 553, "Requested action not taken, %s.", strerror(errno));
                 } else {
-                    ftp_client_msg(session, 250, "Requested file action okay, completed.");
+                    ftp_list_cache_invalidate(session->temp_path.s);
+                    ftp_list_cache_invalidate(dst_path.s);
+                    ftp_client_reply(session, FTP_REPLY(250, "Requested file action okay, completed."));
                 }
             }
         }
@@ -1013,29 +2186,28 @@ static void ftp_cmd_RNTO(struct FtpSession* session, const char* data) {
 // ABOR <CRLF> | 225, 226, 500, 501, 502, 421
 static void ftp_cmd_ABOR(struct FtpSession* session, const char* data) {
     if (session->data_connection == FTP_DATA_CONNECTION_NONE) {
-        ftp_client_msg(session, 226, "Closing data connection.");
+        ftp_client_reply(session, FTP_REPLY(226, "Closing data connection."));
     } else {
-        if (session->transfer.mode == FTP_TRANSFER_MODE_NONE) {
+        if (!session->transfer || session->transfer->mode == FTP_TRANSFER_MODE_NONE) {
             ftp_data_transfer_end(session);
-            ftp_client_msg(session, 225, "Data connection open; no transfer in progress.");
+            ftp_client_reply(session, FTP_REPLY(225, "Data connection open; no transfer in progress."));
         } else {
             ftp_data_transfer_end(session);
-            ftp_client_msg(session, 426, "Connection closed; transfer aborted.");
-            ftp_client_msg(session, 226, "Closing data connection.");
+            ftp_client_reply(session, FTP_REPLY(426, "Connection closed; transfer aborted."));
+            ftp_client_reply(session, FTP_REPLY(226, "Closing data connection."));
         }
     }
 }
 
 // used by DELE and RMD
 static void ftp_remove_file(struct FtpSession* session, const char* data, int (*func)(const char*)) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        struct Pathname fullpath = {0};
-        rc = build_fullpath(session, &fullpath, pathname);
+        struct Pathname fullpath;
+        rc = build_fullpath(session, &fullpath, data);
         if (rc < 0) {
             ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
         } else {
@@ -1043,7 +2215,8 @@ static void ftp_remove_file(struct FtpSession* session, const char* data, int (*
             if (rc < 0) {
                 ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
             } else {
-                ftp_client_msg(session, 250, "Requested file action okay, completed.");
+                ftp_list_cache_invalidate(fullpath.s);
+                ftp_client_reply(session, FTP_REPLY(250, "Requested file action okay, completed."));
             }
         }
     }
@@ -1061,14 +2234,13 @@ static void ftp_cmd_RMD(struct FtpSession* session, const char* data) {
 
 // MKD  <SP> <pathname> <CRLF> | 257, 500, 501, 502, 421, 530, 550
 static void ftp_cmd_MKD(struct FtpSession* session, const char* data) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (!data[0]) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        struct Pathname fullpath = {0};
-        rc = build_fullpath(session, &fullpath, pathname);
+        struct Pathname fullpath;
+        rc = build_fullpath(session, &fullpath, data);
         if (rc < 0) {
             ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
         } else {
@@ -1076,6 +2248,7 @@ static void ftp_cmd_MKD(struct FtpSession* session, const char* data) {
             if (rc < 0) {
                 ftp_client_msg(session, 550, "Requested action not taken, %s.", strerror(errno));
             } else {
+                ftp_list_cache_invalidate(fullpath.s);
                 ftp_client_msg(session, 257, "\"%s\" created.", fullpath.s);
             }
         }
@@ -1089,18 +2262,22 @@ static void ftp_cmd_PWD(struct FtpSession* session, const char* data) {
 
 // used by LIST and NLIST
 static void ftp_list_directory(struct FtpSession* session, const char* data, enum FTP_TRANSFER_MODE mode) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    if (!ftp_transfer_alloc(session)) {
+        ftp_client_reply(session, FTP_REPLY(451, "Requested action aborted: local error in processing, out of memory."));
+        return;
+    }
+
+    int rc = 0;
 
     // see issue: #2
-    if (rc == 0 || !strcmp("-a", pathname.s) || !strcmp("-la", pathname.s)) {
-        session->temp_path = session->pwd;
+    if (!data[0] || !strcmp("-a", data) || !strcmp("-la", data)) {
+        strcpy(session->temp_path.s, session->pwd.s);
     } else {
-        rc = build_fullpath(session, &session->temp_path, pathname);
+        rc = build_fullpath(session, &session->temp_path, data);
     }
 
-    if (rc < 0 || rc >= sizeof(pathname)) {
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+    if (rc < 0) {
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
         struct stat st = {0};
         rc = ftp_vfs_lstat(session->temp_path.s, &st);
@@ -1108,24 +2285,44 @@ static void ftp_list_directory(struct FtpSession* session, const char* data, enu
             ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to stat path: %s.", strerror(errno), session->temp_path.s);
         } else {
             if (S_ISDIR(st.st_mode)) {
-                rc = ftp_vfs_opendir(&session->transfer.dir_vfs, session->temp_path.s);
-                if (rc < 0) {
-                    ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->temp_path.s);
-                } else {
+#if FTP_LIST_CACHE_SIZE
+                unsigned gen;
+                session->transfer->list_cached = ftp_list_cache_get(session, session->temp_path.s, mode, st.st_mtime, &gen);
+                if (session->transfer->list_cached) {
+                    session->transfer->size = session->transfer->list_cached->size;
                     ftp_data_open(session, mode);
+                } else
+#endif
+                {
+                    rc = ftp_vfs_opendir(&session->transfer->dir_vfs, session->temp_path.s);
+                    if (rc < 0) {
+                        ftp_client_msg(session, 450, "Requested file action not taken. %s. Failed to open dir: %s.", strerror(errno), session->temp_path.s);
+                    } else {
+#if FTP_LIST_CACHE_SIZE
+                        ftp_list_cache_record_start(session, session->temp_path.s, mode, st.st_mtime, gen);
+#endif
+                        ftp_data_open(session, mode);
+                    }
                 }
             } else if (mode == FTP_TRANSFER_MODE_LIST) {
-                rc = ftp_build_list_entry(session, &session->temp_path, pathname.s, &st);
+                rc = ftp_build_list_entry(session, &session->temp_path, data, &st);
                 if (rc < 0) {
                     ftp_client_msg(session, 450, "Requested file action not taken, %s. Failed to build entry: %s.", strerror(errno), session->temp_path.s);
                 } else {
                     ftp_data_open(session, mode);
                 }
+            } else if (mode == FTP_TRANSFER_MODE_MLSD) {
+                ftp_client_msg(session, 501, "Syntax error in parameters or arguments, not a directory: %s.", session->temp_path.s);
             } else {
-                ftp_client_msg(session, 450, "Requested file action not taken. Nlist on file is not valid.");
+                ftp_client_reply(session, FTP_REPLY(450, "Requested file action not taken. Nlist on file is not valid."));
             }
         }
     }
+
+    // only keep the transfer state around if the transfer was started.
+    if (session->transfer && session->transfer->mode == FTP_TRANSFER_MODE_NONE) {
+        ftp_transfer_free(session);
+    }
 }
 
 // LIST [<SP> <pathname>] <CRLF> | 125, 150, 226, 250, 425, 426, 451, 450, 500, 501, 502, 421, 530
@@ -1140,62 +2337,82 @@ static void ftp_cmd_NLST(struct FtpSession* session, const char* data) {
 
 // SITE [<SP> <string>] <CRLF> | 200, 202, 500, 501, 530
 static void ftp_cmd_SITE(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+    ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
 }
 
 // SYST <CRLF> | 215, 500, 501, 502, 421
 static void ftp_cmd_SYST(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 215, "UNIX Type: L8");
+    ftp_client_reply(session, FTP_REPLY(215, "UNIX Type: L8"));
 }
 
 // STAT [<SP> <string>] <CRLF> | 211, 212, 213, 450, 500, 501, 502, 421, 530
 static void ftp_cmd_STAT(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+    ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
 }
 
 // HELP <CRLF> | 211, 214, 500, 501, 502, 421
 static void ftp_cmd_HELP(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 214, "ftpsrv " FTPSRV_VERSION_STR " By TotalJustice.");
+    ftp_client_reply(session, FTP_REPLY(214, "ftpsrv " FTPSRV_VERSION_STR " By TotalJustice."));
 }
 
 // NOOP <CRLF> | 200, 500, 421
 static void ftp_cmd_NOOP(struct FtpSession* session, const char* data) {
-    ftp_client_msg(session, 200, "Command okay.");
+    ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
 }
 
 // FEAT <CRLF> | 211, 550
 static void ftp_cmd_FEAT(struct FtpSession* session, const char* data) {
+    char facts[64];
+    ftp_build_mlst_facts(session, facts, true);
     ftp_client_msg(session, 211,
         "-Extensions supported:" TELNET_EOL
         " SIZE" TELNET_EOL
         " UTF8" TELNET_EOL
         " MDTM" TELNET_EOL
         " TVFS" TELNET_EOL
+        " MLST %s" TELNET_EOL,
+        facts
     );
 }
 
 // OPTS <SP> <opts> <CRLF> | 200, 501
 static void ftp_cmd_OPTS(struct FtpSession* session, const char* data) {
     if (!strcasecmp(data, "UTF8 ON")) {
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else if (!strcasecmp(data, "UTF8 OFF")) {
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
     } else if (!strcasecmp(data, "UTF8")) {
-        ftp_client_msg(session, 200, "Command okay.");
+        ftp_client_reply(session, FTP_REPLY(200, "Command okay."));
+    } else if (!strncasecmp(data, "MLST", 4) && (data[4] == ' ' || !data[4])) {
+        // unknown facts are ignored, an empty list disables all facts.
+        session->mlst_facts = 0;
+        for (const char* fact = data + 4; *fact; ) {
+            fact += strspn(fact, " ;");
+            const size_t len = strcspn(fact, ";");
+            for (size_t i = 0; i < FTP_ARR_SZ(FTP_MLST_FACTS); i++) {
+                if (len == strlen(FTP_MLST_FACTS[i].name) && !strncasecmp(fact, FTP_MLST_FACTS[i].name, len)) {
+                    session->mlst_facts |= FTP_MLST_FACTS[i].fact;
+                }
+            }
+            fact += len;
+        }
+
+        char facts[64];
+        ftp_build_mlst_facts(session, facts, false);
+        ftp_client_msg(session, 200, "MLST OPTS %s", facts);
     } else {
         ftp_client_msg(session, 501, "Syntax error in parameters or arguments. %s", data);
     }
 }
 
 static int ftp_get_stat(struct FtpSession* session, const char* data, struct Pathname* fullpath, struct stat* st) {
-    struct Pathname pathname = {0};
-    int rc = snprintf(pathname.s, sizeof(pathname), "%s", data);
+    int rc;
 
-    if (rc <= 0 || rc >= sizeof(pathname)) {
+    if (!data[0]) {
         rc = -1;
-        ftp_client_msg(session, 501, "Syntax error in parameters or arguments.");
+        ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments."));
     } else {
-        rc = build_fullpath(session, fullpath, pathname);
+        rc = build_fullpath(session, fullpath, data);
         if (rc < 0) {
             ftp_client_msg(session, 501, "Syntax error in parameters or arguments, %s.", strerror(errno));
         } else {
@@ -1212,18 +2429,22 @@ static int ftp_get_stat(struct FtpSession* session, const char* data, struct Pat
 // SIZE <SP> <pathname> <CRLF> | 213, 501, 550
 static void ftp_cmd_SIZE(struct FtpSession* session, const char* data) {
     struct stat st = {0};
-    struct Pathname fullpath = {0};
+    struct Pathname fullpath;
     int rc = ftp_get_stat(session, data, &fullpath, &st);
 
     if (!rc) {
-        ftp_client_msg(session, 213, "%d", st.st_size);
+        char* msg = ftp_client_begin(session, 32);
+        if (msg) {
+            char* p = ftp_fmt_uint(ftp_fmt_str(msg, "213 "), st.st_size, 10);
+            ftp_client_commit(session, 213, msg, p - msg);
+        }
     }
 }
 
 // MDTM <SP> <pathname> <CRLF> | 200, 501
 static void ftp_cmd_MDTM(struct FtpSession* session, const char* data) {
     struct stat st = {0};
-    struct Pathname fullpath = {0};
+    struct Pathname fullpath;
     int rc = ftp_get_stat(session, data, &fullpath, &st);
 
     if (!rc) {
@@ -1231,144 +2452,344 @@ static void ftp_cmd_MDTM(struct FtpSession* session, const char* data) {
         if (!unpack_time(&st.st_mtime, &tm)) {
             ftp_client_msg(session, 550, "Syntax error in parameters or arguments, %s. Failed to get timestamp: %s", strerror(errno), fullpath.s);
         } else {
-            ftp_client_msg(session, 213, "%04d%02d%02d%02d%02d", tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec);
+            char* msg = ftp_client_begin(session, 32);
+            if (msg) {
+                char* p = ftp_fmt_str(msg, "213 ");
+                p = ftp_fmt_digits(p, tm.tm_year + 1900, 4);
+                p = ftp_fmt_digits(p, tm.tm_mon + 1, 2);
+                p = ftp_fmt_digits(p, tm.tm_mday, 2);
+                p = ftp_fmt_digits(p, tm.tm_hour, 2);
+                p = ftp_fmt_digits(p, tm.tm_min, 2);
+                p = ftp_fmt_digits(p, tm.tm_sec, 2);
+                ftp_client_commit(session, 213, msg, p - msg);
+            }
+        }
+    }
+}
+
+// MLSD [<SP> <pathname>] <CRLF> | 150, 226, 250, 425, 426, 451, 450, 501, 530
+static void ftp_cmd_MLSD(struct FtpSession* session, const char* data) {
+    ftp_list_directory(session, data, FTP_TRANSFER_MODE_MLSD);
+}
+
+// MLST [<SP> <pathname>] <CRLF> | 250, 501, 530, 550
+static void ftp_cmd_MLST(struct FtpSession* session, const char* data) {
+    struct stat st = {0};
+    struct Pathname fullpath;
+    int rc = ftp_get_stat(session, data[0] ? data : session->pwd.s, &fullpath, &st);
+
+    if (!rc) {
+        // the path appears twice, so the reply is sized from it rather than FTP_SENDBUF_SIZE.
+        const size_t path_len = strlen(fullpath.s);
+        const size_t size = path_len * 2 + 256;
+        if (size > sizeof(session->send_buf)) {
+            ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments, path too long."));
+            return;
+        }
+
+        // commands only need FTP_SENDBUF_SIZE free, earlier replies may still be queued.
+        if (ftp_client_room(session, size) < size) {
+            ftp_client_reply(session, FTP_REPLY(451, "Requested action aborted: local error in processing, reply queue full."));
+            return;
+        }
+
+        char* msg = ftp_client_begin(session, size);
+        if (msg) {
+            char* p = ftp_fmt_str(msg, "250-Listing ");
+            memcpy(p, fullpath.s, path_len);
+            p = ftp_fmt_str(p + path_len, TELNET_EOL " ");
+
+            // the entry ends with TELNET_EOL, leave room for the END line.
+            rc = ftp_build_mlst_entry(session, p, msg + size - p - 16, fullpath.s, &st);
+            if (rc < 0) {
+                ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments, path too long."));
+            } else {
+                p = ftp_fmt_str(p + rc, "250 END");
+                ftp_client_commit(session, 250, msg, p - msg);
+            }
         }
     }
 }
 
 static const struct FtpCommand FTP_COMMANDS[] = {
     // ACCESS CONTROL COMMANDS: https://datatracker.ietf.org/doc/html/rfc959#section-4
-    { .name = "USER", .func = ftp_cmd_USER, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
-    { .name = "PASS", .func = ftp_cmd_PASS, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
-    { .name = "ACCT", .func = ftp_cmd_ACCT, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
-    { .name = "CWD",  .func = ftp_cmd_CWD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "CDUP", .func = ftp_cmd_CDUP, .auth_required = 1, .args_required = 0, .data_connection_required = 0 },
-    { .name = "SMNT", .func = ftp_cmd_SMNT, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "REIN", .func = ftp_cmd_REIN, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
-    { .name = "QUIT", .func = ftp_cmd_QUIT, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
+    { .name = "USER", .func = ftp_cmd_USER, .auth_required = 0, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "PASS", .func = ftp_cmd_PASS, .auth_required = 0, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "ACCT", .func = ftp_cmd_ACCT, .auth_required = 0, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "CWD",  .func = ftp_cmd_CWD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "CDUP", .func = ftp_cmd_CDUP, .auth_required = 1, .args_required = 0, .data_connection_required = 0, .blocking = 1 },
+    { .name = "SMNT", .func = ftp_cmd_SMNT, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "REIN", .func = ftp_cmd_REIN, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "QUIT", .func = ftp_cmd_QUIT, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
 
     // TRANSFER PARAMETER COMMANDS
-    { .name = "PORT", .func = ftp_cmd_PORT, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "PASV", .func = ftp_cmd_PASV, .auth_required = 1, .args_required = 0, .data_connection_required = 0 },
-    { .name = "TYPE", .func = ftp_cmd_TYPE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "STRU", .func = ftp_cmd_STRU, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "MODE", .func = ftp_cmd_MODE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
+    { .name = "PORT", .func = ftp_cmd_PORT, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "PASV", .func = ftp_cmd_PASV, .auth_required = 1, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "TYPE", .func = ftp_cmd_TYPE, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "STRU", .func = ftp_cmd_STRU, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "MODE", .func = ftp_cmd_MODE, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
 
     // FTP SERVICE COMMANDS
-    { .name = "RETR", .func = ftp_cmd_RETR, .auth_required = 1, .args_required = 1, .data_connection_required = 1 },
-    { .name = "STOR", .func = ftp_cmd_STOR, .auth_required = 1, .args_required = 1, .data_connection_required = 1 },
-    { .name = "APPE", .func = ftp_cmd_APPE, .auth_required = 1, .args_required = 1, .data_connection_required = 1 },
-    { .name = "ALLO", .func = ftp_cmd_ALLO, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "REST", .func = ftp_cmd_REST, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "RNFR", .func = ftp_cmd_RNFR, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "RNTO", .func = ftp_cmd_RNTO, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "ABOR", .func = ftp_cmd_ABOR, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
-    { .name = "DELE", .func = ftp_cmd_DELE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "RMD",  .func = ftp_cmd_RMD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "MKD",  .func = ftp_cmd_MKD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "PWD",  .func = ftp_cmd_PWD,  .auth_required = 1, .args_required = 0, .data_connection_required = 0 },
-    { .name = "LIST", .func = ftp_cmd_LIST, .auth_required = 1, .args_required = 0, .data_connection_required = 1 },
-    { .name = "NLST", .func = ftp_cmd_NLST, .auth_required = 1, .args_required = 0, .data_connection_required = 1 },
-    { .name = "SITE", .func = ftp_cmd_SITE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "SYST", .func = ftp_cmd_SYST, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
-    { .name = "STAT", .func = ftp_cmd_STAT, .auth_required = 1, .args_required = 0, .data_connection_required = 0 },
-    { .name = "HELP", .func = ftp_cmd_HELP, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
-    { .name = "NOOP", .func = ftp_cmd_NOOP, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
+    { .name = "RETR", .func = ftp_cmd_RETR, .auth_required = 1, .args_required = 1, .data_connection_required = 1, .blocking = 1 },
+    { .name = "STOR", .func = ftp_cmd_STOR, .auth_required = 1, .args_required = 1, .data_connection_required = 1, .blocking = 1 },
+    { .name = "APPE", .func = ftp_cmd_APPE, .auth_required = 1, .args_required = 1, .data_connection_required = 1, .blocking = 1 },
+    { .name = "ALLO", .func = ftp_cmd_ALLO, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "REST", .func = ftp_cmd_REST, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "RNFR", .func = ftp_cmd_RNFR, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "RNTO", .func = ftp_cmd_RNTO, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "ABOR", .func = ftp_cmd_ABOR, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "DELE", .func = ftp_cmd_DELE, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "RMD",  .func = ftp_cmd_RMD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "MKD",  .func = ftp_cmd_MKD,  .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "PWD",  .func = ftp_cmd_PWD,  .auth_required = 1, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "LIST", .func = ftp_cmd_LIST, .auth_required = 1, .args_required = 0, .data_connection_required = 1, .blocking = 1 },
+    { .name = "NLST", .func = ftp_cmd_NLST, .auth_required = 1, .args_required = 0, .data_connection_required = 1, .blocking = 1 },
+    { .name = "SITE", .func = ftp_cmd_SITE, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "SYST", .func = ftp_cmd_SYST, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "STAT", .func = ftp_cmd_STAT, .auth_required = 1, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "HELP", .func = ftp_cmd_HELP, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
+    { .name = "NOOP", .func = ftp_cmd_NOOP, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
 
     // extensions
-    { .name = "FEAT", .func = ftp_cmd_FEAT, .auth_required = 0, .args_required = 0, .data_connection_required = 0 },
+    { .name = "FEAT", .func = ftp_cmd_FEAT, .auth_required = 0, .args_required = 0, .data_connection_required = 0, .blocking = 0 },
     // RFC 3659: https://datatracker.ietf.org/doc/html/rfc3659
-    { .name = "SIZE", .func = ftp_cmd_SIZE, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "MDTM", .func = ftp_cmd_MDTM, .auth_required = 1, .args_required = 1, .data_connection_required = 0 },
-    { .name = "OPTS", .func = ftp_cmd_OPTS, .auth_required = 0, .args_required = 1, .data_connection_required = 0 },
+    { .name = "SIZE", .func = ftp_cmd_SIZE, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "MDTM", .func = ftp_cmd_MDTM, .auth_required = 1, .args_required = 1, .data_connection_required = 0, .blocking = 1 },
+    { .name = "OPTS", .func = ftp_cmd_OPTS, .auth_required = 0, .args_required = 1, .data_connection_required = 0, .blocking = 0 },
+    { .name = "MLSD", .func = ftp_cmd_MLSD, .auth_required = 1, .args_required = 0, .data_connection_required = 1, .blocking = 1 },
+    { .name = "MLST", .func = ftp_cmd_MLST, .auth_required = 1, .args_required = 0, .data_connection_required = 0, .blocking = 1 },
 };
 
-static int ftp_session_init(struct FtpSession* session) {
-    struct sockaddr_in sa;
-    size_t addr_len = sizeof(sa);
-    memset(session, 0, sizeof(*session));
+// packs the verb into an int, upper-cased so that the lookup is case-insensitive.
+static uint32_t ftp_cmd_verb(const char* name) {
+    uint32_t verb = 0;
+    for (int i = 0; i < 4 && name[i]; i++) {
+        unsigned char c = name[i];
+        if (c >= 'a' && c <= 'z') {
+            c -= 'a' - 'A';
+        }
+        verb |= (uint32_t)c << (i * 8);
+    }
+    return verb;
+}
+
+static size_t ftp_cmd_slot(uint32_t verb) {
+    return (uint32_t)(verb * 2654435761u) >> (32 - g_ftp->command_bits);
+}
+
+// returns the id of the command or 0 if not found.
+static unsigned ftp_cmd_find(uint32_t verb) {
+    const size_t mask = ((size_t)1 << g_ftp->command_bits) - 1;
+    for (size_t i = ftp_cmd_slot(verb); g_ftp->commands[i].id; i = (i + 1) & mask) {
+        if (g_ftp->commands[i].verb == verb) {
+            return g_ftp->commands[i].id;
+        }
+    }
+    return 0;
+}
+
+// built-in commands are added first so that they take priority over custom commands of the same name.
+static int ftp_cmd_table_init(void) {
+    const size_t custom_count = g_ftp->cfg.custom_command ? g_ftp->cfg.custom_command_count : 0;
+    const size_t count = FTP_ARR_SZ(FTP_COMMANDS) + custom_count;
+
+    // keep the table at most half full so that probes stay short.
+    g_ftp->command_bits = 4;
+    while (((size_t)1 << g_ftp->command_bits) < count * 2) {
+        g_ftp->command_bits++;
+    }
+
+    const size_t mask = ((size_t)1 << g_ftp->command_bits) - 1;
+    if (!(g_ftp->commands = calloc(mask + 1, sizeof(*g_ftp->commands)))) {
+        return -1;
+    }
+
+    for (size_t id = 1; id <= count; id++) {
+        const char* name = id <= FTP_ARR_SZ(FTP_COMMANDS) ? FTP_COMMANDS[id - 1].name : g_ftp->cfg.custom_command[id - 1 - FTP_ARR_SZ(FTP_COMMANDS)].name;
+        // names longer than 4 chars can never match.
+        if (!memchr(name, '\0', 5)) {
+            continue;
+        }
+
+        const uint32_t verb = ftp_cmd_verb(name);
+        if (!ftp_cmd_find(verb)) {
+            size_t i = ftp_cmd_slot(verb);
+            while (g_ftp->commands[i].id) {
+                i = (i + 1) & mask;
+            }
+            g_ftp->commands[i].verb = verb;
+            g_ftp->commands[i].id = id;
+        }
+    }
+
+    return 0;
+}
+
+static int ftp_session_init(struct FtpSession* session, const struct FtpSocket* sock, const struct sockaddr_in* sa) {
+    session->control_sock = *sock;
+    session->control_sockaddr = *sa;
+
+    session->weight = 1;
+    session->mlst_facts = FTP_MLST_FACT_ALL;
+    if (g_ftp->cfg.weight_callback) {
+        const unsigned weight = g_ftp->cfg.weight_callback(inet_ntoa(sa->sin_addr));
+        if (weight) {
+            session->weight = weight;
+        }
+    }
 
-    int rc = ftp_socket_accept(&session->control_sock, &g_ftp.server_sock, (struct sockaddr*)&sa, &addr_len);
+    size_t addr_len = sizeof(session->control_sockaddr);
+    const int rc = ftp_socket_getsockname(&session->control_sock, (struct sockaddr*)&session->control_sockaddr, &addr_len);
     if (rc < 0) {
+        ftp_socket_close(&session->control_sock);
+        ftp_client_msg(session, 451, "Failed to get connection info, %s.", strerror(errno));
         return rc;
     } else {
-        ftp_set_server_socket_options(&session->control_sock);
-        session->control_sockaddr = sa;
-        addr_len = sizeof(session->control_sockaddr);
-
-        rc = ftp_socket_getsockname(&session->control_sock, (struct sockaddr*)&session->control_sockaddr, &addr_len);
-        if (rc < 0) {
-            ftp_socket_close(&session->control_sock);
-            ftp_client_msg(session, 451, "Failed to get connection info, %s.", strerror(errno));
-            return rc;
-        } else {
-            session->state = FTP_SESSION_STATE_POLLIN;
-            ftp_update_session_time(session);
-            strcpy(session->pwd.s, "/");
-            g_ftp.session_count++;
-            ftp_client_msg(session, 220, "Service ready for new user.");
-            return 0;
-        }
+        session->state = FTP_SESSION_STATE_POLLIN;
+        ftp_update_session_time(session);
+        strcpy(session->pwd.s, "/");
+        ftp_client_reply(session, FTP_REPLY(220, "Service ready for new user."));
+        return 0;
     }
 }
 
+// the session is only freed by ftp_session_release() as the caller may still be using it.
 static void ftp_session_close(struct FtpSession* session) {
     if (session->state != FTP_SESSION_STATE_NONE) {
-        ftp_data_transfer_end(session);
         ftp_socket_close(&session->control_sock);
-        memset(session, 0, sizeof(*session));
-        g_ftp.session_count--;
+        session->state = FTP_SESSION_STATE_NONE;
+    }
+}
+
+// stops polling the listener whilst there are no fds left, as it stays readable and would spin the loop.
+static void ftp_accept_pause(void) {
+    g_ftp->accept_paused = ftp_get_timestamp_ms() + FTP_ACCEPT_BACKOFF_MS;
+#if FTP_SOCKET_POLL_SET
+    ftp_socket_pollset_mod(&g_ftp->poll_set, &g_ftp->server_sock, 0, 0);
+#endif
+}
+
+static void ftp_accept_resume(void) {
+    if (g_ftp->accept_paused) {
+        g_ftp->accept_paused = 0;
+#if FTP_SOCKET_POLL_SET
+        ftp_socket_pollset_mod(&g_ftp->poll_set, &g_ftp->server_sock, FtpSocketPollType_IN, 0);
+#endif
+    }
+}
+
+// frees the session and its slot if it has been closed.
+static void ftp_session_release(struct FtpSession* session) {
+    if (session->state == FTP_SESSION_STATE_NONE) {
+        ftp_data_transfer_end(session);
+        ftp_timer_remove(session);
+        g_ftp->sessions[session->index] = NULL;
+        g_ftp->free_slots[g_ftp->free_slot_count++] = session->index;
+        g_ftp->session_count--;
+#if FTP_VFS_ASYNC
+        free(session->job);
+#endif
+        free(session);
+
+        // the session's fds are free again.
+        ftp_accept_resume();
     }
 }
 
+#if FTP_VFS_ASYNC
+#if FTP_SOCKET_POLL_SET
+static void ftp_session_update_poll(struct FtpSession* session);
+#endif
+
+static void ftp_session_job(struct FtpVfsAsyncJob* job) {
+    struct FtpSessionJob* session_job = (struct FtpSessionJob*)job;
+    g_ftp = session_job->ftp;
+    g_ftp_job = session_job;
+    session_job->cmd->func(session_job->session, session_job->args);
+    g_ftp_job = NULL;
+}
+
+// runs the command on a worker, the session is not touched by the loop until it completes.
+static int ftp_session_suspend(struct FtpSession* session, const struct FtpCommand* cmd, const char* args) {
+    struct FtpSessionJob* job = malloc(sizeof(*job));
+    if (!job) {
+        return -1;
+    }
+
+    job->job.func = ftp_session_job;
+    job->ftp = g_ftp;
+    job->session = session;
+    job->cmd = cmd;
+    job->logs_size = 0;
+    snprintf(job->args, sizeof(job->args), "%s", args);
+
+    // replies to earlier pipelined commands are sent before the worker may queue more.
+    if (session->send_buf_size) {
+        ftp_session_send(session);
+        if (session->state == FTP_SESSION_STATE_NONE) {
+            free(job);
+            return 0;
+        }
+    }
+
+    // the command gets the full timeout to complete.
+    ftp_update_session_time(session);
+
+    session->job = job;
+    session->state = FTP_SESSION_STATE_BLOCKING;
+    // the session stays queued so that it still times out if the command never completes.
+    if (session->timer_slot) {
+        ftp_timer_sift(session->timer_slot - 1);
+    }
+#if FTP_SOCKET_POLL_SET
+    // the worker may close the data socket, so remove it from the poll set first.
+    ftp_session_update_poll(session);
+#endif
+
+    if (ftp_vfs_async_submit(g_ftp->async, &job->job) < 0) {
+        session->job = NULL;
+        free(job);
+        session->state = session->send_buf_size ? FTP_SESSION_STATE_POLLOUT : FTP_SESSION_STATE_POLLIN;
+        ftp_update_session_time(session);
+        return -1;
+    }
+
+    return 0;
+}
+#endif
+
 static void ftp_session_progress_line(struct FtpSession* session, const char* line, size_t line_len) {
     char cmd_name[5] = {0};
     int rc = snprintf(cmd_name, sizeof(cmd_name), "%s", line);
     if (rc <= 0) {
-        ftp_client_msg(session, 500, "Syntax error, command unrecognized.");
+        ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command unrecognized."));
     } else {
         // correctly NULL cmd at the first space / TELNET_EOL
         for (int i = 0; cmd_name[i]; i++) {
             if (cmd_name[i] == ' ' || !strcmp(cmd_name + i, TELNET_EOL)) {
                 cmd_name[i] = '\0';
-                break;
-            }
-        }
-
-        ftp_log_callback(FTP_API_LOG_TYPE_COMMAND, cmd_name);
-
-        // find command and execute
-        int command_id = -1;
-        bool custom_command = false;
-        for (size_t i = 0; i < FTP_ARR_SZ(FTP_COMMANDS); i++) {
-            if (!strncasecmp(cmd_name, FTP_COMMANDS[i].name, sizeof(cmd_name))) {
-                command_id = i;
-                break;
-            }
-        }
-
-        if (command_id < 0 && g_ftp.cfg.custom_command && g_ftp.cfg.custom_command_count) {
-            for (size_t i = 0; i < g_ftp.cfg.custom_command_count; i++) {
-                if (!strncasecmp(cmd_name, g_ftp.cfg.custom_command[i].name, sizeof(cmd_name))) {
-                    custom_command = true;
-                    command_id = i;
-                    break;
-                }
+                break;
             }
         }
 
-        if (command_id < 0) {
+        ftp_log_callback(FTP_API_LOG_TYPE_COMMAND, cmd_name);
+
+        // find command and execute
+        const unsigned command_id = ftp_cmd_find(ftp_cmd_verb(cmd_name));
+        const bool custom_command = command_id > FTP_ARR_SZ(FTP_COMMANDS);
+
+        if (!command_id) {
             ftp_client_msg(session, 500, "Syntax error, command \"%s\" unrecognized.", cmd_name);
         } else {
             if (custom_command) {
-                const struct FtpSrvCustomCommand* cmd = &g_ftp.cfg.custom_command[command_id];
+                const struct FtpSrvCustomCommand* cmd = &g_ftp->cfg.custom_command[command_id - 1 - FTP_ARR_SZ(FTP_COMMANDS)];
                 const char* cmd_args = memchr(line + strlen(cmd->name), ' ', line_len - strlen(cmd->name));
 
                 // validate the command
                 if (cmd->args_required && !cmd_args) {
-                    ftp_client_msg(session, 501, "Syntax error in parameters or arguments, missing required args.");
+                    ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments, missing required args."));
                 } else if (cmd->auth_required && session->auth_mode != FTP_AUTH_MODE_VALID) {
-                    ftp_client_msg(session, 530, "Not logged in.");
+                    ftp_client_reply(session, FTP_REPLY(530, "Not logged in."));
                 } else {
                     const char* args = cmd_args ? cmd_args + 1 : "\0";
                     char msg_buf[FTP_SENDBUF_SIZE - 10] = {0};
@@ -1376,18 +2797,23 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
                     ftp_client_msg(session, code, "%s", msg_buf);
                 }
             } else {
-                const struct FtpCommand* cmd = &FTP_COMMANDS[command_id];
+                const struct FtpCommand* cmd = &FTP_COMMANDS[command_id - 1];
                 const char* cmd_args = memchr(line + strlen(cmd->name), ' ', line_len - strlen(cmd->name));
 
                 // validate the command
                 if (cmd->args_required && !cmd_args) {
-                    ftp_client_msg(session, 501, "Syntax error in parameters or arguments, missing required args.");
+                    ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments, missing required args."));
                 } else if (cmd->auth_required && session->auth_mode != FTP_AUTH_MODE_VALID) {
-                    ftp_client_msg(session, 530, "Not logged in.");
+                    ftp_client_reply(session, FTP_REPLY(530, "Not logged in."));
                 } else if (cmd->data_connection_required && session->data_connection == FTP_DATA_CONNECTION_NONE) {
-                    ftp_client_msg(session, 501, "Syntax error in parameters or arguments, no data connection.");
+                    ftp_client_reply(session, FTP_REPLY(501, "Syntax error in parameters or arguments, no data connection."));
                 } else {
                     const char* args = cmd_args ? cmd_args + 1 : "\0";
+#if FTP_VFS_ASYNC
+                    if (cmd->blocking && g_ftp->async && !ftp_session_suspend(session, cmd, args)) {
+                        return;
+                    }
+#endif
                     cmd->func(session, args);
                 }
             }
@@ -1395,8 +2821,9 @@ static void ftp_session_progress_line(struct FtpSession* session, const char* li
     }
 }
 
+// sends all queued replies at once.
 static void ftp_session_send(struct FtpSession* session) {
-    int rc = ftp_socket_send(&session->control_sock, session->send_buf + session->send_buf_offset, session->send_buf_size - session->send_buf_offset, 0);
+    int rc = ftp_socket_send(&session->control_sock, session->send_buf + session->send_buf_offset, session->send_buf_size, 0);
     if (rc < 0) {
         if (errno != EWOULDBLOCK && errno != EAGAIN) {
             ftp_session_close(session);
@@ -1406,6 +2833,7 @@ static void ftp_session_send(struct FtpSession* session) {
         session->send_buf_size -= rc;
 
         if (!session->send_buf_size) {
+            session->send_buf_offset = 0;
             session->state = FTP_SESSION_STATE_POLLIN;
         }
     }
@@ -1413,8 +2841,90 @@ static void ftp_session_send(struct FtpSession* session) {
     ftp_update_session_time(session);
 }
 
+// returns the length of the next line including TELNET_EOL, which is replaced with NULL, or 0 if the line is incomplete.
+static size_t ftp_session_next_line(struct FtpSession* session) {
+    char* start = session->cmd_buf + session->cmd_buf_offset;
+    char* end = start + session->cmd_buf_size;
+
+    // resume from where the last search stopped, the '\r' may have been the last byte read.
+    for (char* p = start + session->cmd_buf_scan; (p = memchr(p, '\n', end - p)); p++) {
+        if (p != start && p[-1] == '\r') {
+            p[-1] = '\0';
+            session->cmd_buf_scan = 0;
+            return p + 1 - start;
+        }
+    }
+
+    session->cmd_buf_scan = session->cmd_buf_size;
+    return 0;
+}
+
+// makes room for the rest of an incomplete line once the end of the buffer is reached.
+static void ftp_session_compact_lines(struct FtpSession* session) {
+    if (session->cmd_buf_offset + session->cmd_buf_size != sizeof(session->cmd_buf)) {
+        return;
+    }
+
+    if (session->cmd_buf_offset) {
+        memmove(session->cmd_buf, session->cmd_buf + session->cmd_buf_offset, session->cmd_buf_size);
+        session->cmd_buf_offset = 0;
+    } else {
+        // no room for TELNET_EOL, so drop the line up to the next one.
+        if (!session->cmd_buf_discard) {
+            session->cmd_buf_discard = true;
+            ftp_client_reply(session, FTP_REPLY(500, "Syntax error, command line too long."));
+        }
+
+        // keep a trailing '\r' in case the '\n' is in the next read.
+        session->cmd_buf_size = session->cmd_buf[session->cmd_buf_size - 1] == '\r';
+        session->cmd_buf[0] = '\r';
+        session->cmd_buf_scan = session->cmd_buf_size;
+    }
+}
+
+// runs each complete line in the command buffer, stopping early if a command blocks.
+static void ftp_session_progress_lines(struct FtpSession* session) {
+    session->send_deferred = true;
+
+    while (session->cmd_buf_size && session->state != FTP_SESSION_STATE_NONE && session->state != FTP_SESSION_STATE_BLOCKING) {
+        // the rest is processed once there is room for another reply.
+        if (sizeof(session->send_buf) - session->send_buf_size < FTP_SENDBUF_SIZE) {
+            ftp_session_send(session);
+            if (session->state != FTP_SESSION_STATE_POLLIN) {
+                break;
+            }
+        }
+
+        const size_t line_len = ftp_session_next_line(session);
+        if (!line_len) {
+            ftp_session_compact_lines(session);
+            break;
+        }
+
+        // consume line.
+        const char* line = session->cmd_buf + session->cmd_buf_offset;
+        session->cmd_buf_offset += line_len;
+        session->cmd_buf_size -= line_len;
+        if (!session->cmd_buf_size) {
+            session->cmd_buf_offset = 0;
+        }
+
+        if (session->cmd_buf_discard) {
+            session->cmd_buf_discard = false;
+        } else {
+            ftp_session_progress_line(session, line, line_len);
+        }
+    }
+
+    session->send_deferred = false;
+    if (session->state == FTP_SESSION_STATE_POLLOUT) {
+        ftp_session_send(session);
+    }
+}
+
 static void ftp_session_poll(struct FtpSession* session) {
-    int rc = ftp_socket_recv(&session->control_sock, session->cmd_buf + session->cmd_buf_size, sizeof(session->cmd_buf) - session->cmd_buf_size, 0);
+    const size_t end = session->cmd_buf_offset + session->cmd_buf_size;
+    int rc = ftp_socket_recv(&session->control_sock, session->cmd_buf + end, sizeof(session->cmd_buf) - end, 0);
     if (rc < 0) {
         if (errno != EWOULDBLOCK && errno != EAGAIN) {
             ftp_session_close(session);
@@ -1423,191 +2933,595 @@ static void ftp_session_poll(struct FtpSession* session) {
         ftp_session_close(session);
     } else {
         session->cmd_buf_size += rc;
-        while (session->cmd_buf_size) {
-            size_t line_len = 0;
-            for (size_t i = 0; i < session->cmd_buf_size - 1; i++) {
-                if (!memcmp(session->cmd_buf + i, TELNET_EOL, strlen(TELNET_EOL))) {
-                    // replace TELNET_EOL with NULL as to terminate the string.
-                    session->cmd_buf[i] = '\0';
-                    line_len = i + strlen(TELNET_EOL);
-                    break;
-                }
+        ftp_session_progress_lines(session);
+    }
+
+    ftp_update_session_time(session);
+}
+
+// returns the events to poll the control socket for.
+static enum FtpSocketPollType ftp_session_control_events(const struct FtpSession* session) {
+    if (session->state == FTP_SESSION_STATE_POLLIN) {
+        return FtpSocketPollType_IN;
+    } else if (session->state == FTP_SESSION_STATE_POLLOUT) {
+        return FtpSocketPollType_OUT;
+    }
+    return 0;
+}
+
+// returns the socket used for the data transfer along with the events to poll for.
+static struct FtpSocket* ftp_session_data_events(struct FtpSession* session, enum FtpSocketPollType* events) {
+    if (session->state == FTP_SESSION_STATE_NONE || session->state == FTP_SESSION_STATE_BLOCKING || !session->transfer || session->transfer->mode == FTP_TRANSFER_MODE_NONE) {
+        *events = 0;
+        return NULL;
+    }
+
+    // wait until the socket is ready to connect.
+    if (session->transfer->connection_pending) {
+        if (session->data_connection == FTP_DATA_CONNECTION_PASSIVE) {
+            *events = FtpSocketPollType_IN;
+            return &session->pasv_sock;
+        } else {
+            *events = FtpSocketPollType_OUT;
+            return &session->data_sock;
+        }
+    }
+
+    if (session->transfer->mode == FTP_TRANSFER_MODE_STOR) {
+        *events = FtpSocketPollType_IN;
+    } else {
+        *events = FtpSocketPollType_OUT;
+    }
+    return &session->data_sock;
+}
+
+static void ftp_session_control_progress(struct FtpSession* session, enum FtpSocketPollType revents) {
+    if (session->state == FTP_SESSION_STATE_BLOCKING) {
+        // events are handled once the command completes.
+    } else if (revents & FtpSocketPollType_ERROR) {
+        ftp_session_close(session);
+    } else if (revents & FtpSocketPollType_IN) {
+        ftp_session_poll(session);
+    } else if (revents & FtpSocketPollType_OUT) {
+        ftp_session_send(session);
+        // run the lines that were held back until the replies were sent.
+        if (session->state == FTP_SESSION_STATE_POLLIN && session->cmd_buf_size) {
+            ftp_session_progress_lines(session);
+        }
+    }
+}
+
+static void ftp_session_data_progress(struct FtpSession* session, enum FtpSocketPollType revents) {
+    // don't close data transfer on error as it will confuse the client (ffmpeg)
+    if (session->state != FTP_SESSION_STATE_NONE && session->state != FTP_SESSION_STATE_BLOCKING && session->transfer && session->transfer->mode != FTP_TRANSFER_MODE_NONE) {
+        if (revents & (FtpSocketPollType_IN | FtpSocketPollType_OUT)) {
+            if (session->transfer->connection_pending) {
+                ftp_data_poll(session);
+            } else {
+                ftp_data_transfer_progress(session);
             }
+        }
+    }
+}
 
-            if (!line_len) {
-                // no room for TELNET_EOL, so reset the buffer.
-                if (session->cmd_buf_size == sizeof(session->cmd_buf)) {
-                    session->cmd_buf_size = 0;
-                }
-                break;
+#if FTP_SOCKET_POLL_SET
+// poll set ids, the server socket is 0, followed by the control / data socket of each session.
+// completed vfs jobs are signalled with the last id.
+#define FTP_POLL_ASYNC_ID ((size_t)-1)
+
+static inline size_t ftp_poll_control_id(size_t index) {
+    return 1 + index * 2;
+}
+
+static inline size_t ftp_poll_data_id(size_t index) {
+    return 1 + index * 2 + 1;
+}
+
+// only updates the poll set if the session changed what it is waiting on.
+static void ftp_session_update_poll(struct FtpSession* session) {
+    if (session->state == FTP_SESSION_STATE_NONE) {
+        return;
+    }
+
+    const size_t index = session->index;
+    const enum FtpSocketPollType control_events = ftp_session_control_events(session);
+    if (control_events != session->poll_control_events) {
+        if (!control_events) {
+            ftp_socket_pollset_del(&g_ftp->poll_set, &session->control_sock);
+        } else if (!session->poll_control_events) {
+            ftp_socket_pollset_add(&g_ftp->poll_set, &session->control_sock, control_events, ftp_poll_control_id(index));
+        } else {
+            ftp_socket_pollset_mod(&g_ftp->poll_set, &session->control_sock, control_events, ftp_poll_control_id(index));
+        }
+        session->poll_control_events = control_events;
+    }
+
+    enum FtpSocketPollType data_events;
+    struct FtpSocket* data_sock = ftp_session_data_events(session, &data_events);
+    if (data_sock != session->poll_data_sock) {
+        if (session->poll_data_sock) {
+            ftp_socket_pollset_del(&g_ftp->poll_set, session->poll_data_sock);
+        }
+        if (data_sock) {
+            ftp_socket_pollset_add(&g_ftp->poll_set, data_sock, data_events, ftp_poll_data_id(index));
+        }
+    } else if (data_sock && data_events != session->poll_data_events) {
+        ftp_socket_pollset_mod(&g_ftp->poll_set, data_sock, data_events, ftp_poll_data_id(index));
+    }
+    session->poll_data_sock = data_sock;
+    session->poll_data_events = data_events;
+}
+#endif
+
+// sends a reply to a connection that won't get a session and closes it.
+static void ftp_session_reject(struct FtpSocket* sock) {
+    static const char msg[] = "421 Service not available, too many connections." TELNET_EOL;
+    ftp_socket_send(sock, msg, sizeof(msg) - 1, 0);
+    ftp_socket_close(sock);
+}
+
+// accepts all pending connections.
+static void ftp_session_accept(void) {
+    while (1) {
+        struct FtpSocket sock = {0};
+        struct sockaddr_in sa;
+        size_t addr_len = sizeof(sa);
+
+        if (ftp_socket_accept(&sock, &g_ftp->server_sock, (struct sockaddr*)&sa, &addr_len) < 0) {
+            if (errno == EMFILE || errno == ENFILE) {
+                ftp_accept_pause();
             }
+            break;
+        }
+        ftp_set_server_socket_options(&sock);
+
+        struct FtpSession* session = NULL;
+        if (g_ftp->free_slot_count) {
+            session = calloc(1, sizeof(*session));
+        }
+
+        if (!session) {
+            ftp_session_reject(&sock);
+            continue;
+        }
 
-            // consume line.
-            ftp_session_progress_line(session, session->cmd_buf, line_len);
-            memcpy(session->cmd_buf, session->cmd_buf + line_len, session->cmd_buf_size - line_len);
-            session->cmd_buf_size -= line_len;
+        session->index = g_ftp->free_slots[--g_ftp->free_slot_count];
+        g_ftp->sessions[session->index] = session;
+        g_ftp->session_count++;
+
+        ftp_session_init(session, &sock, &sa);
+        if (session->state == FTP_SESSION_STATE_NONE) {
+            ftp_session_release(session);
+        }
+#if FTP_SOCKET_POLL_SET
+        else {
+            ftp_session_update_poll(session);
         }
+#endif
     }
+}
 
-    ftp_update_session_time(session);
+// handles the deadlines of all sessions that are due.
+static void ftp_session_expire(void) {
+    const uint64_t now = ftp_get_timestamp_ms();
+
+    while (g_ftp->timer_count && ftp_session_deadline(g_ftp->timer_heap[0]) <= now) {
+        struct FtpSession* session = g_ftp->timer_heap[0];
+
+#if FTP_VFS_ASYNC
+        // the worker still owns the session, so it is closed once the command completes.
+        if (session->state == FTP_SESSION_STATE_BLOCKING) {
+            session->job_expired = true;
+            ftp_timer_remove(session);
+            continue;
+        }
+#endif
+
+        if (session->data_deadline && session->data_deadline <= now) {
+            if (session->transfer && session->transfer->connection_pending) {
+                ftp_client_reply(session, FTP_REPLY(425, "Can't open data connection, timed out."));
+            } else {
+                ftp_client_reply(session, FTP_REPLY(426, "Connection closed; transfer aborted, timed out."));
+            }
+            ftp_data_transfer_end(session);
+        }
+
+        if (session->control_deadline <= now) {
+            ftp_session_close(session);
+        }
+
+        if (session->state == FTP_SESSION_STATE_NONE) {
+            ftp_session_release(session);
+        } else {
+            // sending the reply refreshed the control deadline.
+            ftp_timer_update(session);
+#if FTP_SOCKET_POLL_SET
+            ftp_session_update_poll(session);
+#endif
+        }
+    }
 }
 
-int ftpsrv_init(const struct FtpSrvConfig* cfg) {
+#if FTP_VFS_ASYNC
+// sends the replies of each completed command and carries on with any pipelined commands.
+static void ftp_session_resume(void) {
+    struct FtpVfsAsyncJob* job;
+    while ((job = ftp_vfs_async_complete(g_ftp->async))) {
+        const struct FtpSessionJob* session_job = (const struct FtpSessionJob*)job;
+        struct FtpSession* session = session_job->session;
+
+        for (size_t i = 0; i < session_job->logs_size; i += 2 + strlen(session_job->logs + i + 1)) {
+            ftp_log_callback((enum FTP_API_LOG_TYPE)session_job->logs[i], session_job->logs + i + 1);
+        }
+
+        free(session->job);
+        session->job = NULL;
+
+        if (session->job_expired) {
+            ftp_session_close(session);
+        } else {
+            session->state = FTP_SESSION_STATE_POLLIN;
+            if (session->send_buf_size) {
+                session->state = FTP_SESSION_STATE_POLLOUT;
+                ftp_session_send(session);
+            }
+            ftp_update_session_time(session);
+            ftp_session_progress_lines(session);
+        }
+
+        if (session->state == FTP_SESSION_STATE_NONE) {
+            ftp_session_release(session);
+        }
+#if FTP_SOCKET_POLL_SET
+        else {
+            ftp_session_update_poll(session);
+        }
+#endif
+    }
+}
+#endif
+
+static int ftp_srv_init(const struct FtpSrvConfig* cfg) {
     int rc;
+    memcpy(&g_ftp->cfg, cfg, sizeof(*cfg));
+#if FTP_LIST_CACHE_SIZE
+    ftp_list_cache_attach();
+#endif
+
+    g_ftp->max_sessions = cfg->max_sessions ? cfg->max_sessions : FTP_MAX_SESSIONS;
+    g_ftp->transfer_quantum = cfg->transfer_quantum ? cfg->transfer_quantum : FTP_TRANSFER_QUANTUM;
+    g_ftp->sessions = calloc(g_ftp->max_sessions, sizeof(*g_ftp->sessions));
+    g_ftp->free_slots = calloc(g_ftp->max_sessions, sizeof(*g_ftp->free_slots));
+    g_ftp->timer_heap = calloc(g_ftp->max_sessions, sizeof(*g_ftp->timer_heap));
+#if FTP_SOCKET_POLL_SET
+    g_ftp->poll_events = calloc(2 + g_ftp->max_sessions * 2, sizeof(*g_ftp->poll_events));
+    const bool alloc_ok = g_ftp->poll_events;
+#else
+    g_ftp->poll_entries = calloc(2 + g_ftp->max_sessions * 2, sizeof(*g_ftp->poll_entries));
+    g_ftp->poll_fds = calloc(2 + g_ftp->max_sessions * 2, sizeof(*g_ftp->poll_fds));
+    const bool alloc_ok = g_ftp->poll_entries && g_ftp->poll_fds;
+#endif
+
+    // hand out the lowest slots first.
+    if (g_ftp->free_slots) {
+        for (size_t i = 0; i < g_ftp->max_sessions; i++) {
+            g_ftp->free_slots[g_ftp->free_slot_count++] = g_ftp->max_sessions - 1 - i;
+        }
+    }
 
-    if (g_ftp.initialised || !cfg) {
+    if (!g_ftp->sessions || !g_ftp->free_slots || !g_ftp->timer_heap || !alloc_ok || ftp_cmd_table_init()) {
+        errno = ENOMEM;
         rc = -1;
+    } else if ((rc = ftp_socket_open(&g_ftp->server_sock, PF_INET, SOCK_STREAM, 0)) < 0) {
     } else {
-        memset(&g_ftp, 0, sizeof(g_ftp));
-        memcpy(&g_ftp.cfg, cfg, sizeof(*cfg));
-        g_ftp.initialised = 1;
+        ftp_set_server_socket_options(&g_ftp->server_sock);
+        if (cfg->reuse_port) {
+            ftp_socket_set_reuseport_enable(&g_ftp->server_sock, 1);
+        }
+
+        struct sockaddr_in sa = {
+            .sin_family = PF_INET,
+            .sin_port = htons(cfg->port),
+            .sin_addr.s_addr = INADDR_ANY,
+        };
 
-        rc = ftp_socket_open(&g_ftp.server_sock, PF_INET, SOCK_STREAM, 0);
+        rc = ftp_socket_bind(&g_ftp->server_sock, (struct sockaddr*)&sa, sizeof(sa));
         if (rc < 0) {
         } else {
-            ftp_set_server_socket_options(&g_ftp.server_sock);
+            rc = ftp_socket_listen(&g_ftp->server_sock, cfg->backlog ? cfg->backlog : FTP_LISTEN_BACKLOG);
+        }
 
-            struct sockaddr_in sa = {
-                .sin_family = PF_INET,
-                .sin_port = htons(cfg->port),
-                .sin_addr.s_addr = INADDR_ANY,
-            };
+#if FTP_SOCKET_POLL_SET
+        if (rc >= 0) {
+            rc = ftp_socket_pollset_open(&g_ftp->poll_set);
+            if (rc >= 0) {
+                rc = ftp_socket_pollset_add(&g_ftp->poll_set, &g_ftp->server_sock, FtpSocketPollType_IN, 0);
+            }
+        }
+#endif
 
-            rc = ftp_socket_bind(&g_ftp.server_sock, (struct sockaddr*)&sa, sizeof(sa));
-            if (rc < 0) {
-            } else {
-                rc = ftp_socket_listen(&g_ftp.server_sock, 5); /* SOMAXCONN */
+#if FTP_VFS_ASYNC
+        if (rc >= 0 && cfg->vfs_threads) {
+            g_ftp->async = ftp_vfs_async_create(cfg->vfs_threads);
+            if (!g_ftp->async) {
+                rc = -1;
             }
+#if FTP_SOCKET_POLL_SET
+            else {
+                rc = ftp_socket_pollset_add(&g_ftp->poll_set, ftp_vfs_async_socket(g_ftp->async), FtpSocketPollType_IN, FTP_POLL_ASYNC_ID);
+            }
+#endif
         }
+#endif
     }
 
     return rc;
 }
 
-int ftpsrv_loop(int timeout_ms) {
-    if (!g_ftp.initialised) {
-        return FTP_API_LOOP_ERROR_INIT;
+static int ftp_srv_loop(int timeout_ms) {
+    // don't sleep past the next deadline.
+    if (g_ftp->timer_count) {
+        const uint64_t now = ftp_get_timestamp_ms();
+        const uint64_t deadline = ftp_session_deadline(g_ftp->timer_heap[0]);
+        const uint64_t wait = deadline > now ? deadline - now : 0;
+        if (timeout_ms < 0 || wait < (uint64_t)timeout_ms) {
+            timeout_ms = wait > INT32_MAX ? INT32_MAX : (int)wait;
+        }
+    }
+
+    // nor past the time the listener is retried, fds may be freed by more than closing sessions.
+    if (g_ftp->accept_paused) {
+        const uint64_t now = ftp_get_timestamp_ms();
+        if (now >= g_ftp->accept_paused) {
+            ftp_accept_resume();
+        } else if (timeout_ms < 0 || g_ftp->accept_paused - now < (uint64_t)timeout_ms) {
+            timeout_ms = (int)(g_ftp->accept_paused - now);
+        }
     }
 
-    // close all sessions that have expired.
-    if (g_ftp.cfg.timeout) {
-        const time_t cur_time = time(NULL);
-        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-            struct FtpSession* session = &g_ftp.sessions[i];
-            if (session->state != FTP_SESSION_STATE_NONE) {
-                if (difftime(cur_time, session->last_update_time) >= g_ftp.cfg.timeout) {
-                    ftp_session_close(session);
+#if FTP_SOCKET_POLL_SET
+    struct FtpSocketPollEvent* events = g_ftp->poll_events;
+    const int rc = ftp_socket_pollset_wait(&g_ftp->poll_set, events, 2 + g_ftp->max_sessions * 2, timeout_ms);
+    if (rc < 0) {
+        return FTP_API_LOOP_ERROR_INIT;
+    } else {
+        bool accept_pending = false;
+        bool resume_pending = false;
+
+        // control events are handled first so that replies are never queued behind bulk data.
+        for (int i = 0; i < rc; i++) {
+            const size_t id = events[i].id;
+
+            if (!id) {
+                if (events[i].revents & FtpSocketPollType_ERROR) {
+                    return FTP_API_LOOP_ERROR_INIT;
+                } else if (events[i].revents & FtpSocketPollType_IN) {
+                    accept_pending = true;
+                }
+            } else if (id == FTP_POLL_ASYNC_ID) {
+                resume_pending = true;
+            } else {
+                const size_t index = (id - 1) / 2;
+                if (id == ftp_poll_control_id(index) && g_ftp->sessions[index]) {
+                    ftp_session_control_progress(g_ftp->sessions[index], events[i].revents);
+                }
+            }
+        }
+
+        // then each ready transfer gets its quantum.
+        for (int i = 0; i < rc; i++) {
+            const size_t id = events[i].id;
+            const size_t index = (id - 1) / 2;
+
+            if (id && id != FTP_POLL_ASYNC_ID && id == ftp_poll_data_id(index) && g_ftp->sessions[index]) {
+                ftp_session_data_progress(g_ftp->sessions[index], events[i].revents);
+            }
+        }
+
+        for (int i = 0; i < rc; i++) {
+            const size_t id = events[i].id;
+
+            if (id && id != FTP_POLL_ASYNC_ID) {
+                // the session may have been released by an earlier event.
+                struct FtpSession* session = g_ftp->sessions[(id - 1) / 2];
+                if (!session) {
+                    continue;
+                }
+
+                if (session->state == FTP_SESSION_STATE_NONE) {
+                    ftp_session_release(session);
+                } else if (session->state != FTP_SESSION_STATE_BLOCKING) {
+                    ftp_session_update_poll(session);
                 }
             }
         }
+
+#if FTP_VFS_ASYNC
+        if (resume_pending) {
+            ftp_session_resume();
+        }
+#endif
+
+        if (accept_pending) {
+            ftp_session_accept();
+        }
     }
 
-    static struct FtpSocketPollEntry fds[1 + FTP_MAX_SESSIONS * 2] = {0};
-    static struct FtpSocketPollFd poll_fds[1 + FTP_MAX_SESSIONS * 2] = {0};
-    const size_t nfds = FTP_ARR_SZ(fds);
+    ftp_session_expire();
+#else
+    struct FtpSocketPollEntry* fds = g_ftp->poll_entries;
+    size_t nfds = 1 + g_ftp->max_sessions * 2;
 
     // initialise fds.
-    memset(fds, 0, sizeof(fds));
+    memset(fds, 0, sizeof(*fds) * nfds);
 
-    // add server socket to the first entry.
-    if (g_ftp.session_count < FTP_MAX_SESSIONS) {
-        fds[0].fd = &g_ftp.server_sock;
-        fds[0].events = FtpSocketPollType_IN;
-    }
+    // add server socket to the first entry, connections over the limit are rejected.
+    fds[0].fd = &g_ftp->server_sock;
+    fds[0].events = g_ftp->accept_paused ? 0 : FtpSocketPollType_IN;
 
     // add each session control and data socket.
-    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
+    for (size_t i = 0; i < g_ftp->max_sessions; i++) {
         const size_t si = 1 + i * 2;
         const size_t sd = 1 + i * 2 + 1;
-        struct FtpSession* session = &g_ftp.sessions[i];
-
-        if (session->state != FTP_SESSION_STATE_NONE) {
-            if (session->state == FTP_SESSION_STATE_POLLIN) {
-                fds[si].fd = &session->control_sock;
-                fds[si].events = FtpSocketPollType_IN;
-            } else if (session->state == FTP_SESSION_STATE_POLLOUT) {
-                fds[si].fd = &session->control_sock;
-                fds[si].events = FtpSocketPollType_OUT;
-            }
+        struct FtpSession* session = g_ftp->sessions[i];
 
-            if (session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                // wait until the socket is ready to connect.
-                if (session->transfer.connection_pending) {
-                    if (session->data_connection == FTP_DATA_CONNECTION_PASSIVE) {
-                        fds[sd].fd = &session->pasv_sock;
-                        fds[sd].events = FtpSocketPollType_IN;
-                    } else {
-                        fds[sd].fd = &session->data_sock;
-                        fds[sd].events = FtpSocketPollType_OUT;
-                    }
-                } else {
-                    fds[sd].fd = &session->data_sock;
-                    if (session->transfer.mode == FTP_TRANSFER_MODE_STOR) {
-                        fds[sd].events = FtpSocketPollType_IN;
-                    } else {
-                        fds[sd].events = FtpSocketPollType_OUT;
-                    }
-                }
-            }
+        if (session) {
+            fds[si].fd = &session->control_sock;
+            fds[si].events = ftp_session_control_events(session);
+            fds[sd].fd = ftp_session_data_events(session, &fds[sd].events);
         }
     }
 
-    const int rc = ftp_socket_poll(fds, poll_fds, nfds, timeout_ms);
+#if FTP_VFS_ASYNC
+    // completed vfs jobs are signalled with the last entry.
+    if (g_ftp->async) {
+        fds[nfds++] = (struct FtpSocketPollEntry){ .fd = ftp_vfs_async_socket(g_ftp->async), .events = FtpSocketPollType_IN };
+    }
+#endif
+
+    const int rc = ftp_socket_poll(fds, g_ftp->poll_fds, nfds, timeout_ms);
     if (rc < 0) {
         return FTP_API_LOOP_ERROR_INIT;
     } else {
         if (fds[0].revents & FtpSocketPollType_ERROR) {
             return FTP_API_LOOP_ERROR_INIT;
         } else if (fds[0].revents & FtpSocketPollType_IN) {
-            for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-                if (g_ftp.sessions[i].state == FTP_SESSION_STATE_NONE) {
-                    ftp_session_init(&g_ftp.sessions[i]);
-                    break;
-                }
-            }
+            ftp_session_accept();
         }
 
-        for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-            const size_t si = 1 + i * 2;
-            const size_t sd = 1 + i * 2 + 1;
-            struct FtpSession* session = &g_ftp.sessions[i];
-
-            // if (fds[si].revents & (POLLERR | POLLHUP | POLLNVAL)) {
-            if (fds[si].revents & FtpSocketPollType_ERROR) {
-                ftp_session_close(session);
-            } else if (fds[si].revents & FtpSocketPollType_IN) {
-                ftp_session_poll(session);
-            } else if (fds[si].revents & FtpSocketPollType_OUT) {
-                ftp_session_send(session);
+        // control events are handled first so that replies are never queued behind bulk data.
+        for (size_t i = 0; i < g_ftp->max_sessions; i++) {
+            if (g_ftp->sessions[i]) {
+                ftp_session_control_progress(g_ftp->sessions[i], fds[1 + i * 2].revents);
             }
+        }
 
-            // don't close data transfer on error as it will confuse the client (ffmpeg)
-            if (session->state != FTP_SESSION_STATE_NONE && session->transfer.mode != FTP_TRANSFER_MODE_NONE) {
-                if (fds[sd].revents & (FtpSocketPollType_IN | FtpSocketPollType_OUT)) {
-                    if (session->transfer.connection_pending) {
-                        ftp_data_poll(session);
-                    } else {
-                        ftp_data_transfer_progress(session);
-                    }
-                }
+        // then each ready transfer gets its quantum.
+        for (size_t i = 0; i < g_ftp->max_sessions; i++) {
+            if (g_ftp->sessions[i]) {
+                ftp_session_data_progress(g_ftp->sessions[i], fds[1 + i * 2 + 1].revents);
+                ftp_session_release(g_ftp->sessions[i]);
             }
         }
+
+#if FTP_VFS_ASYNC
+        if (g_ftp->async && fds[nfds - 1].revents) {
+            ftp_session_resume();
+        }
+#endif
     }
 
+    ftp_session_expire();
+#endif
+
     return FTP_API_LOOP_ERROR_OK;
 }
 
-void ftpsrv_exit(void) {
-    if (!g_ftp.initialised) {
-        return;
+static void ftp_srv_exit(void) {
+#if FTP_VFS_ASYNC
+    // wait for running commands before their sessions are freed.
+    if (g_ftp->async) {
+        ftp_vfs_async_destroy(g_ftp->async);
+        g_ftp->async = NULL;
     }
+#endif
 
-    for (size_t i = 0; i < FTP_ARR_SZ(g_ftp.sessions); i++) {
-        if (g_ftp.sessions[i].state != FTP_SESSION_STATE_NONE) {
-            ftp_session_close(&g_ftp.sessions[i]);
+    if (g_ftp->sessions) {
+        for (size_t i = 0; i < g_ftp->max_sessions; i++) {
+            struct FtpSession* session = g_ftp->sessions[i];
+            if (session) {
+                ftp_session_close(session);
+                ftp_session_release(session);
+            }
         }
     }
 
-    ftp_socket_close(&g_ftp.server_sock);
-    g_ftp.initialised = 0;
+    ftp_socket_close(&g_ftp->server_sock);
+#if FTP_SOCKET_POLL_SET
+    ftp_socket_pollset_close(&g_ftp->poll_set);
+    free(g_ftp->poll_events);
+#else
+    free(g_ftp->poll_entries);
+    free(g_ftp->poll_fds);
+#endif
+
+    free(g_ftp->sessions);
+    free(g_ftp->free_slots);
+    free(g_ftp->timer_heap);
+    free(g_ftp->commands);
+
+#if FTP_LIST_CACHE_SIZE
+    ftp_list_cache_detach();
+#endif
+
+    while (g_ftp->buf_pool_count) {
+        free(g_ftp->buf_pool[--g_ftp->buf_pool_count]);
+    }
+}
+
+struct FtpSrv* ftpsrv_create(const struct FtpSrvConfig* cfg) {
+    if (!cfg) {
+        return NULL;
+    }
+
+    struct FtpSrv* ftp = calloc(1, sizeof(*ftp));
+    if (!ftp) {
+        return NULL;
+    }
+
+    struct FtpSrv* prev = g_ftp;
+    g_ftp = ftp;
+
+    if (ftp_srv_init(cfg) < 0) {
+        const int err = errno;
+        ftp_srv_exit();
+        free(ftp);
+        ftp = NULL;
+        errno = err;
+    }
+
+    g_ftp = prev;
+    return ftp;
+}
+
+int ftpsrv_poll(struct FtpSrv* ftp, int timeout_ms) {
+    if (!ftp) {
+        return FTP_API_LOOP_ERROR_INIT;
+    }
+
+    struct FtpSrv* prev = g_ftp;
+    g_ftp = ftp;
+    const int rc = ftp_srv_loop(timeout_ms);
+    g_ftp = prev;
+    return rc;
+}
+
+void ftpsrv_destroy(struct FtpSrv* ftp) {
+    if (!ftp) {
+        return;
+    }
+
+    struct FtpSrv* prev = g_ftp;
+    g_ftp = ftp;
+    ftp_srv_exit();
+    g_ftp = prev;
+    free(ftp);
+}
+
+int ftpsrv_init(const struct FtpSrvConfig* cfg) {
+    if (g_ftp_default) {
+        return -1;
+    }
+
+    g_ftp_default = ftpsrv_create(cfg);
+    return g_ftp_default ? 0 : -1;
+}
+
+int ftpsrv_loop(int timeout_ms) {
+    return ftpsrv_poll(g_ftp_default, timeout_ms);
+}
+
+void ftpsrv_exit(void) {
+    ftpsrv_destroy(g_ftp_default);
+    g_ftp_default = NULL;
 }
@@ -24,6 +24,9 @@ enum FTP_API_LOOP_ERROR {
 
 typedef void (*FtpSrvLogCallback)(enum FTP_API_LOG_TYPE, const char*);
 typedef void (*FtpSrvProgressCallback)(void);
+// returns the transfer weight of a new session from its address, 0 uses the default of 1.
+// a session with a weight of 2 may move twice as many bytes per loop as a session with 1.
+typedef unsigned (*FtpSrvWeightCallback)(const char* addr);
 
 struct FtpSrvCustomCommand {
     char name[5];
@@ -48,14 +51,43 @@ struct FtpSrvConfig {
     bool use_localtime;
     // if set, sessions will be closed once this is elapsed.
     unsigned timeout;
+    // max number of concurrent sessions, if 0, FTP_MAX_SESSIONS is used.
+    unsigned max_sessions;
+    // max number of pending connections, if 0, FTP_LISTEN_BACKLOG is used.
+    // connections over max_sessions are sent 421 and closed.
+    unsigned backlog;
+    // bytes each ready transfer may move per loop, if 0, FTP_TRANSFER_QUANTUM is used.
+    unsigned transfer_quantum;
+    // if set, the listener is opened with SO_REUSEPORT so that multiple
+    // threads (see FTP_THREADS) can each run a server on the same port.
+    bool reuse_port;
+    // number of worker threads that run commands which touch the vfs, such as
+    // RETR, LIST or MKD, so that a slow filesystem does not stall other sessions.
+    // if 0 or the vfs does not support FTP_VFS_ASYNC, commands are run on the loop
+    // and no threads are created, regardless of FTP_THREADS.
+    // a command that takes longer than timeout closes its session once it returns.
+    unsigned vfs_threads;
 
     const struct FtpSrvCustomCommand* custom_command;
     unsigned custom_command_count;
 
+    // only called from the thread running the server, including for commands run by vfs_threads.
     FtpSrvLogCallback log_callback;
     FtpSrvProgressCallback progress_callback;
+    FtpSrvWeightCallback weight_callback;
 };
 
+struct FtpSrv;
+
+// creates a server listening on cfg->port, returns NULL on error.
+// each server is independent, if built with FTP_THREADS, servers may be
+// run on different threads, but each server must only be used by one thread.
+struct FtpSrv* ftpsrv_create(const struct FtpSrvConfig* cfg);
+// waits up to timeout_ms for events and handles them, returns FTP_API_LOOP_ERROR.
+int ftpsrv_poll(struct FtpSrv* ftp, int timeout_ms);
+void ftpsrv_destroy(struct FtpSrv* ftp);
+
+// wrappers around a single default server (one per thread if built with FTP_THREADS).
 int ftpsrv_init(const struct FtpSrvConfig* cfg);
 int ftpsrv_loop(int timeout_ms);
 void ftpsrv_exit(void);
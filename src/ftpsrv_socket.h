@@ -21,7 +21,13 @@ struct FtpSocketPollEntry {
     enum FtpSocketPollType revents;
 };
 
+struct FtpSocketPollEvent {
+    size_t id;
+    enum FtpSocketPollType revents;
+};
+
 struct FtpSocketPollFd;
+struct FtpSocketPollSet;
 struct FtpSocketLen;
 struct FtpSocket;
 
@@ -40,6 +46,7 @@ int ftp_socket_getsockname(struct FtpSocket* sock, struct sockaddr* addr, size_t
 
 // socket options
 int ftp_socket_set_reuseaddr_enable(struct FtpSocket* sock, int enable);
+int ftp_socket_set_reuseport_enable(struct FtpSocket* sock, int enable);
 int ftp_socket_set_nodelay_enable(struct FtpSocket* sock, int enable);
 int ftp_socket_set_keepalive_enable(struct FtpSocket* sock, int enable);
 int ftp_socket_set_throughput_enable(struct FtpSocket* sock, int enable);
@@ -48,6 +55,15 @@ int ftp_socket_set_nonblocking_enable(struct FtpSocket* sock, int enable);
 // socket polling, may internally use select() if poll() is not available.
 int ftp_socket_poll(struct FtpSocketPollEntry* entries, struct FtpSocketPollFd* fds, size_t nfds, int timeout);
 
+// persistent socket polling, only available if the socket header defines FTP_SOCKET_POLL_SET.
+// sockets are registered once with an id, only sockets that are ready are returned.
+int ftp_socket_pollset_open(struct FtpSocketPollSet* set);
+int ftp_socket_pollset_close(struct FtpSocketPollSet* set);
+int ftp_socket_pollset_add(struct FtpSocketPollSet* set, struct FtpSocket* sock, enum FtpSocketPollType events, size_t id);
+int ftp_socket_pollset_mod(struct FtpSocketPollSet* set, struct FtpSocket* sock, enum FtpSocketPollType events, size_t id);
+int ftp_socket_pollset_del(struct FtpSocketPollSet* set, struct FtpSocket* sock);
+int ftp_socket_pollset_wait(struct FtpSocketPollSet* set, struct FtpSocketPollEvent* events, size_t max_events, int timeout);
+
 #ifdef FTP_SOCKET_HEADER
     #include FTP_SOCKET_HEADER
 #else
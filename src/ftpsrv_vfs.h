@@ -56,6 +56,7 @@ struct FtpVfsStat {
 struct FtpVfsFile;
 struct FtpVfsDir;
 struct FtpVfsDirEntry;
+struct FtpSocket;
 
 int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode);
 int ftp_vfs_read(struct FtpVfsFile* f, void* buf, size_t size);
@@ -66,7 +67,13 @@ int ftp_vfs_close(struct FtpVfsFile* f);
 int ftp_vfs_isfile_open(struct FtpVfsFile* f);
 
 int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path);
+// returns NULL at the end of the dir, or on error with errno set, like readdir().
 const char* ftp_vfs_readdir(struct FtpVfsDir* f, struct FtpVfsDirEntry* entry);
+// optional, only available if the vfs header defines FTP_VFS_READDIR_BATCH, must not be mixed with ftp_vfs_readdir().
+// reads up to max entries at once, names[i] is the name of entries[i] and stays valid until the next call.
+// returns the number of entries read, 0 at the end of the dir or -1 on error.
+int ftp_vfs_readdir_batch(struct FtpVfsDir* f, struct FtpVfsDirEntry* entries, const char** names, size_t max);
+// path is the full path of the entry, NULL if the vfs header defines FTP_VFS_DIRLSTAT_AT.
 int ftp_vfs_dirlstat(struct FtpVfsDir* f, const struct FtpVfsDirEntry* entry, const char* path, struct stat* st);
 int ftp_vfs_closedir(struct FtpVfsDir* f);
 int ftp_vfs_isdir_open(struct FtpVfsDir* f);
@@ -82,6 +89,39 @@ int ftp_vfs_readlink(const char* path, char* buf, size_t buflen);
 const char* ftp_vfs_getpwuid(const struct stat* st);
 const char* ftp_vfs_getgrgid(const struct stat* st);
 
+// optional, only available if the vfs header defines FTP_VFS_SENDFILE.
+// sends the file starting at off to the socket, buf is scratch space that may be used.
+// returns the number of bytes sent, 0 on eof or -1 on error (errno EAGAIN if the socket is full).
+// a result that is not a multiple of size means that the socket is full or eof was reached.
+int ftp_vfs_sendfile(struct FtpVfsFile* f, struct FtpSocket* sock, void* buf, size_t size, size_t off);
+// optional, only available if the vfs header defines FTP_VFS_RECVFILE.
+// writes data received from the socket to the file, buf is scratch space that may be used.
+// returns the number of bytes written, 0 on eof or -1 on error (errno EAGAIN if the socket is empty).
+int ftp_vfs_recvfile(struct FtpVfsFile* f, struct FtpSocket* sock, void* buf, size_t size);
+// optional, only available if the vfs header defines FTP_VFS_SPAN, RETR prefers FTP_VFS_SENDFILE.
+// sets span to the file data starting at off, which stays valid until the next call or close.
+// returns the number of bytes readable from span, 0 on eof or -1 on error.
+// the span is only passed to send(), which fails with EFAULT if the file was truncated under it.
+int ftp_vfs_span(struct FtpVfsFile* f, size_t off, const void** span);
+
+// optional, only available if the vfs header defines FTP_VFS_ASYNC.
+// jobs are run on a pool of worker threads so that blocking vfs calls do not stall the loop.
+// once a job has finished, the socket returned by ftp_vfs_async_socket() becomes readable
+// and the job can be collected with ftp_vfs_async_complete().
+struct FtpVfsAsync;
+struct FtpVfsAsyncJob {
+    void (*func)(struct FtpVfsAsyncJob* job); // called on a worker thread.
+    struct FtpVfsAsyncJob* next; // used internally.
+};
+
+struct FtpVfsAsync* ftp_vfs_async_create(unsigned threads);
+// waits for all submitted jobs to finish, jobs that were not collected are dropped.
+void ftp_vfs_async_destroy(struct FtpVfsAsync* async);
+int ftp_vfs_async_submit(struct FtpVfsAsync* async, struct FtpVfsAsyncJob* job);
+// returns a finished job or NULL if there are none, does not block.
+struct FtpVfsAsyncJob* ftp_vfs_async_complete(struct FtpVfsAsync* async);
+struct FtpSocket* ftp_vfs_async_socket(struct FtpVfsAsync* async);
+
 #ifdef FTP_VFS_HEADER
     #include FTP_VFS_HEADER
 #else
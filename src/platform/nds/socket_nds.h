@@ -91,6 +91,15 @@ static inline int ftp_socket_set_reuseaddr_enable_unistd(struct FtpSocket* sock,
 #endif
 }
 
+static inline int ftp_socket_set_reuseport_enable_unistd(struct FtpSocket* sock, int enable) {
+#if defined(HAVE_SO_REUSEPORT) && HAVE_SO_REUSEPORT
+    const int option = 1;
+    return setsockopt(sock->s, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option));
+#else
+    return 0;
+#endif
+}
+
 static inline int ftp_socket_set_nodelay_enable_unistd(struct FtpSocket* sock, int enable) {
 #if defined(HAVE_TCP_NODELAY) && HAVE_TCP_NODELAY
     const int option = 1;
@@ -241,6 +250,7 @@ static inline int ftp_socket_poll_unistd(struct FtpSocketPollEntry* entries, str
 #define ftp_socket_listen ftp_socket_listen_unistd
 #define ftp_socket_getsockname ftp_socket_getsockname_unistd
 #define ftp_socket_set_reuseaddr_enable ftp_socket_set_reuseaddr_enable_unistd
+#define ftp_socket_set_reuseport_enable ftp_socket_set_reuseport_enable_unistd
 #define ftp_socket_set_nodelay_enable ftp_socket_set_nodelay_enable_unistd
 #define ftp_socket_set_keepalive_enable ftp_socket_set_keepalive_enable_unistd
 #define ftp_socket_set_throughput_enable ftp_socket_set_throughput_enable_unistd
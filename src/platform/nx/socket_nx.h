@@ -117,6 +117,15 @@ static inline int ftp_socket_set_reuseaddr_enable_nx(struct FtpSocket* sock, int
 #endif
 }
 
+static inline int ftp_socket_set_reuseport_enable_nx(struct FtpSocket* sock, int enable) {
+#if defined(HAVE_SO_REUSEPORT) && HAVE_SO_REUSEPORT
+    const int option = 1;
+    return bsd_errno(bsdSetSockOpt(sock->s, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option)));
+#else
+    return 0;
+#endif
+}
+
 static inline int ftp_socket_set_nodelay_enable_nx(struct FtpSocket* sock, int enable) {
 #if defined(HAVE_TCP_NODELAY) && HAVE_TCP_NODELAY
     const int option = 1;
@@ -201,6 +210,7 @@ static inline int ftp_socket_poll_nx(struct FtpSocketPollEntry* entries, struct
 #define ftp_socket_listen ftp_socket_listen_nx
 #define ftp_socket_getsockname ftp_socket_getsockname_nx
 #define ftp_socket_set_reuseaddr_enable ftp_socket_set_reuseaddr_enable_nx
+#define ftp_socket_set_reuseport_enable ftp_socket_set_reuseport_enable_nx
 #define ftp_socket_set_nodelay_enable ftp_socket_set_nodelay_enable_nx
 #define ftp_socket_set_keepalive_enable ftp_socket_set_keepalive_enable_nx
 #define ftp_socket_set_throughput_enable ftp_socket_set_throughput_enable_nx
@@ -16,7 +16,14 @@
     #define lstat stat
 #endif
 
+#if defined(FTP_VFS_SPAN) && FTP_VFS_SPAN
+static void vfs_unmap(struct FtpVfsFile* f);
+#endif
+
 int ftp_vfs_open(struct FtpVfsFile* f, const char* path, enum FtpVfsOpenMode mode) {
+#if defined(FTP_VFS_SPAN) && FTP_VFS_SPAN
+    f->map = NULL;
+#endif
     switch (mode) {
         case FtpVfsOpenMode_READ:
             f->fd = fopen(path, "rb");
@@ -52,6 +59,9 @@ int ftp_vfs_close(struct FtpVfsFile* f) {
     if (!ftp_vfs_isfile_open(f)) {
         return -1;
     }
+#if defined(FTP_VFS_SPAN) && FTP_VFS_SPAN
+    vfs_unmap(f);
+#endif
     int rc = fclose(f->fd);
     f->fd = NULL;
     return rc;
@@ -125,11 +135,11 @@ int ftp_vfs_readlink(const char* path, char* buf, size_t buflen) {
 #endif
 }
 
+#include "../vfs_id_cache.h"
+
 #if defined(HAVE_GETPWUID) && HAVE_GETPWUID
-#include <pwd.h>
 const char* ftp_vfs_getpwuid(const struct stat* st) {
-    const struct passwd *pw = getpwuid(st->st_uid);
-    return pw ? pw->pw_name : "unknown";
+    return vfs_id_cache_getpwuid(st->st_uid);
 }
 #else
 const char* ftp_vfs_getpwuid(const struct stat* st) {
@@ -138,13 +148,145 @@ const char* ftp_vfs_getpwuid(const struct stat* st) {
 #endif
 
 #if defined(HAVE_GETGRGID) && HAVE_GETGRGID
-#include <grp.h>
 const char* ftp_vfs_getgrgid(const struct stat* st) {
-    const struct group *gr = getgrgid(st->st_gid);
-    return gr ? gr->gr_name : "unknown";
+    return vfs_id_cache_getgrgid(st->st_gid);
 }
 #else
 const char* ftp_vfs_getgrgid(const struct stat* st) {
     return "unknown";
 }
 #endif
+
+#if defined(FTP_VFS_SPAN) && FTP_VFS_SPAN
+#include <sys/mman.h>
+#include <stdlib.h>
+
+#if defined(FTP_THREADS) && FTP_THREADS
+    #include <pthread.h>
+#endif
+
+// size of each mapping, keeps address space bounded for huge files.
+// must be a multiple of the page size.
+#ifndef FTP_VFS_MAP_WINDOW
+    #define FTP_VFS_MAP_WINDOW (8 * 1024 * 1024)
+#endif
+
+// sessions sending the same part of the same file share a window.
+struct VfsMapWindow {
+    struct VfsMapWindow* next;
+    unsigned char* map;
+    size_t off;
+    size_t size;
+    dev_t dev;
+    ino_t ino;
+    unsigned refs;
+};
+
+// windows that are currently mapped, there is at most one per RETR.
+static struct VfsMapWindow* g_windows;
+
+#if defined(FTP_THREADS) && FTP_THREADS
+static pthread_mutex_t g_windows_mutex = PTHREAD_MUTEX_INITIALIZER;
+    #define VFS_MAP_LOCK() pthread_mutex_lock(&g_windows_mutex)
+    #define VFS_MAP_UNLOCK() pthread_mutex_unlock(&g_windows_mutex)
+#else
+    #define VFS_MAP_LOCK()
+    #define VFS_MAP_UNLOCK()
+#endif
+
+static struct VfsMapWindow* vfs_map_get(int fd, const struct stat* st, size_t off, size_t size) {
+    VFS_MAP_LOCK();
+    for (struct VfsMapWindow* w = g_windows; w; w = w->next) {
+        if (w->dev == st->st_dev && w->ino == st->st_ino && w->off == off && w->size == size) {
+            w->refs++;
+            VFS_MAP_UNLOCK();
+            return w;
+        }
+    }
+    VFS_MAP_UNLOCK();
+
+    struct VfsMapWindow* w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+
+    void* map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, off);
+    if (map == MAP_FAILED) {
+        free(w);
+        return NULL;
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(map, size, MADV_SEQUENTIAL);
+#endif
+
+    w->map = map;
+    w->off = off;
+    w->size = size;
+    w->dev = st->st_dev;
+    w->ino = st->st_ino;
+    w->refs = 1;
+
+    // another session may have mapped the same window in the meantime, which is
+    // harmless, it just isn't shared.
+    VFS_MAP_LOCK();
+    w->next = g_windows;
+    g_windows = w;
+    VFS_MAP_UNLOCK();
+
+    return w;
+}
+
+static void vfs_unmap(struct FtpVfsFile* f) {
+    struct VfsMapWindow* w = f->map;
+    if (!w) {
+        return;
+    }
+    f->map = NULL;
+
+    VFS_MAP_LOCK();
+    const unsigned refs = --w->refs;
+    if (!refs) {
+        struct VfsMapWindow** prev = &g_windows;
+        while (*prev != w) {
+            prev = &(*prev)->next;
+        }
+        *prev = w->next;
+    }
+    VFS_MAP_UNLOCK();
+
+    if (!refs) {
+        munmap(w->map, w->size);
+        free(w);
+    }
+}
+
+int ftp_vfs_span(struct FtpVfsFile* f, size_t off, const void** span) {
+    struct VfsMapWindow* w = f->map;
+
+    if (!w || off < w->off || off >= w->off + w->size) {
+        vfs_unmap(f);
+
+        // the size is checked per window as the file may have grown.
+        struct stat st;
+        if (fstat(fileno(f->fd), &st) < 0) {
+            return -1;
+        } else if (off >= (size_t)st.st_size) {
+            return 0;
+        }
+
+        const size_t start = off - off % FTP_VFS_MAP_WINDOW;
+        size_t len = st.st_size - start;
+        if (len > FTP_VFS_MAP_WINDOW) {
+            len = FTP_VFS_MAP_WINDOW;
+        }
+
+        if (!(w = vfs_map_get(fileno(f->fd), &st, start, len))) {
+            return -1;
+        }
+        f->map = w;
+    }
+
+    *span = w->map + (off - w->off);
+    return w->off + w->size - off;
+}
+#endif
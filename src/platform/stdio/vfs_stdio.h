@@ -9,8 +9,16 @@ extern "C" {
 #include <stdio.h>
 #include <dirent.h>
 
+#if defined(HAVE_MMAP) && HAVE_MMAP
+    #define FTP_VFS_SPAN 1
+#endif
+
 struct FtpVfsFile {
     FILE* fd;
+#if defined(FTP_VFS_SPAN) && FTP_VFS_SPAN
+    // window of the file that is currently mapped by ftp_vfs_span().
+    struct VfsMapWindow* map;
+#endif
 };
 
 struct FtpVfsDir {
@@ -8,7 +8,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
+#include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -26,7 +28,11 @@ enum ArgsId {
     ArgsId_pass,
     ArgsId_anon,
     ArgsId_timeout,
-    ArgsId_localtime
+    ArgsId_localtime,
+    ArgsId_threads,
+    ArgsId_sessions,
+    ArgsId_backlog,
+    ArgsId_workers
 };
 
 #define ARGS_ENTRY(_key, _type, _single) \
@@ -41,6 +47,10 @@ static const struct ArgsMeta ARGS_META[] = {
     ARGS_ENTRY(anon, ArgsValueType_BOOL, 'a')
     ARGS_ENTRY(timeout, ArgsValueType_INT, 't')
     ARGS_ENTRY(localtime, ArgsValueType_BOOL, 0)
+    ARGS_ENTRY(threads, ArgsValueType_INT, 'T')
+    ARGS_ENTRY(sessions, ArgsValueType_INT, 's')
+    ARGS_ENTRY(backlog, ArgsValueType_INT, 'b')
+    ARGS_ENTRY(workers, ArgsValueType_INT, 'w')
 };
 
 static void ftp_log_callback(enum FTP_API_LOG_TYPE type, const char* msg) {
@@ -68,16 +78,40 @@ Usage\n\n\
     -p, --pass      = Set password.\n\
     -a, --anon      = Enable anonymous login.\n\
     -t, --timeout   = Set session timeout in seconds.\n\
+    -T, --threads   = Set number of threads, each with its own listener.\n\
+    -s, --sessions  = Set max number of sessions per thread.\n\
+    -b, --backlog   = Set max number of pending connections.\n\
+    -w, --workers   = Set number of threads per server that run blocking file commands.\n\
     --localtime     = Use local time over gm time.\n\
     \n");
 
     return code;
 }
 
+static void* ftp_thread(void* userdata) {
+    const struct FtpSrvConfig* ftpsrv_config = userdata;
+
+    while (1) {
+        struct FtpSrv* ftp = ftpsrv_create(ftpsrv_config);
+        while (1) {
+            // session timeouts are handled by ftpsrv_poll().
+            if (ftpsrv_poll(ftp, -1) != FTP_API_LOOP_ERROR_OK) {
+                sleep(1);
+                break;
+            }
+        }
+        ftpsrv_destroy(ftp);
+    }
+
+    return NULL;
+}
+
 int main(int argc, char** argv) {
     struct FtpSrvConfig ftpsrv_config = {
         .log_callback = ftp_log_callback,
+        .backlog = SOMAXCONN,
     };
+    int threads = 1;
 
     int arg_index = 1;
     struct ArgsData arg_data;
@@ -105,6 +139,18 @@ int main(int argc, char** argv) {
             case ArgsId_localtime:
                 ftpsrv_config.use_localtime = arg_data.value.b;
                 break;
+            case ArgsId_threads:
+                threads = arg_data.value.i;
+                break;
+            case ArgsId_sessions:
+                ftpsrv_config.max_sessions = arg_data.value.i;
+                break;
+            case ArgsId_backlog:
+                ftpsrv_config.backlog = arg_data.value.i;
+                break;
+            case ArgsId_workers:
+                ftpsrv_config.vfs_threads = arg_data.value.i;
+                break;
         }
     }
 
@@ -135,6 +181,14 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
+    if (threads < 1) {
+        fprintf(stderr, "threads must be at least 1\n");
+        return EXIT_FAILURE;
+    }
+
+    // each thread opens its own listener on the same port.
+    ftpsrv_config.reuse_port = threads > 1;
+
     unsigned ip = gethostid();
     ip = ((ip & 0xFFFF) << 16) | ((ip >> 16) & 0xFFFF);
     struct in_addr addr = {ip};
@@ -148,20 +202,18 @@ int main(int argc, char** argv) {
     }
     printf(TEXT_YELLOW "timeout: %us" TEXT_NORMAL "\n", ftpsrv_config.timeout);
     printf(TEXT_YELLOW "use_localtime: %u" TEXT_NORMAL "\n", ftpsrv_config.use_localtime);
-
-    int timeout = -1;
-    if (ftpsrv_config.timeout) {
-        timeout = 1000 * ftpsrv_config.timeout;
-    }
-
-    while (1) {
-        ftpsrv_init(&ftpsrv_config);
-        while (1) {
-            if (ftpsrv_loop(timeout) != FTP_API_LOOP_ERROR_OK) {
-                sleep(1);
-                break;
-            }
+    printf(TEXT_YELLOW "threads: %d" TEXT_NORMAL "\n", threads);
+    printf(TEXT_YELLOW "workers: %u" TEXT_NORMAL "\n", ftpsrv_config.vfs_threads);
+
+    // the config is shared read-only between all threads.
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, ftp_thread, &ftpsrv_config)) {
+            fprintf(stderr, "failed to create thread %d\n", i);
+            return EXIT_FAILURE;
         }
-        ftpsrv_exit();
+        pthread_detach(thread);
     }
+
+    ftp_thread(&ftpsrv_config);
 }
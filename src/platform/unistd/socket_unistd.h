@@ -23,6 +23,11 @@ extern "C" {
     #include <sys/select.h>
 #endif
 
+#if defined(HAVE_EPOLL) && HAVE_EPOLL
+    #include <sys/epoll.h>
+    #define FTP_SOCKET_POLL_SET 1
+#endif
+
 struct FtpSocketPollFd {
 #if defined(HAVE_POLL) && HAVE_POLL
     struct pollfd s;
@@ -35,6 +40,16 @@ struct FtpSocket {
     int s;
 };
 
+#if defined(HAVE_EPOLL) && HAVE_EPOLL
+// max number of ready events returned per wait, the rest are returned on the next call.
+#define FTP_SOCKET_POLL_SET_EVENTS 64
+
+struct FtpSocketPollSet {
+    int fd;
+    struct epoll_event events[FTP_SOCKET_POLL_SET_EVENTS];
+};
+#endif
+
 static inline int ftp_socket_open_unistd(struct FtpSocket* sock, int domain, int type, int protocol) {
     return sock->s = socket(domain, type, protocol);
 }
@@ -91,6 +106,15 @@ static inline int ftp_socket_set_reuseaddr_enable_unistd(struct FtpSocket* sock,
 #endif
 }
 
+static inline int ftp_socket_set_reuseport_enable_unistd(struct FtpSocket* sock, int enable) {
+#if defined(HAVE_SO_REUSEPORT) && HAVE_SO_REUSEPORT
+    const int option = 1;
+    return setsockopt(sock->s, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option));
+#else
+    return 0;
+#endif
+}
+
 static inline int ftp_socket_set_nodelay_enable_unistd(struct FtpSocket* sock, int enable) {
 #if defined(HAVE_TCP_NODELAY) && HAVE_TCP_NODELAY
     const int option = 1;
@@ -231,6 +255,71 @@ static inline int ftp_socket_poll_unistd(struct FtpSocketPollEntry* entries, str
 }
 #endif
 
+#if defined(HAVE_EPOLL) && HAVE_EPOLL
+static inline int ftp_socket_pollset_ctl_unistd(struct FtpSocketPollSet* set, int op, struct FtpSocket* sock, enum FtpSocketPollType events, size_t id) {
+    struct epoll_event ev = {0};
+    if (events & FtpSocketPollType_IN) {
+        ev.events |= EPOLLIN;
+    }
+    if (events & FtpSocketPollType_OUT) {
+        ev.events |= EPOLLOUT;
+    }
+    ev.data.u64 = id;
+    return epoll_ctl(set->fd, op, sock->s, &ev);
+}
+
+static inline int ftp_socket_pollset_open_unistd(struct FtpSocketPollSet* set) {
+    return set->fd = epoll_create1(EPOLL_CLOEXEC);
+}
+
+static inline int ftp_socket_pollset_close_unistd(struct FtpSocketPollSet* set) {
+    if (set->fd > 0) {
+        close(set->fd);
+        set->fd = 0;
+    }
+    return 0;
+}
+
+static inline int ftp_socket_pollset_add_unistd(struct FtpSocketPollSet* set, struct FtpSocket* sock, enum FtpSocketPollType events, size_t id) {
+    return ftp_socket_pollset_ctl_unistd(set, EPOLL_CTL_ADD, sock, events, id);
+}
+
+static inline int ftp_socket_pollset_mod_unistd(struct FtpSocketPollSet* set, struct FtpSocket* sock, enum FtpSocketPollType events, size_t id) {
+    return ftp_socket_pollset_ctl_unistd(set, EPOLL_CTL_MOD, sock, events, id);
+}
+
+static inline int ftp_socket_pollset_del_unistd(struct FtpSocketPollSet* set, struct FtpSocket* sock) {
+    return ftp_socket_pollset_ctl_unistd(set, EPOLL_CTL_DEL, sock, 0, 0);
+}
+
+static inline int ftp_socket_pollset_wait_unistd(struct FtpSocketPollSet* set, struct FtpSocketPollEvent* events, size_t max_events, int timeout) {
+    if (max_events > FTP_SOCKET_POLL_SET_EVENTS) {
+        max_events = FTP_SOCKET_POLL_SET_EVENTS;
+    }
+
+    const int rc = epoll_wait(set->fd, set->events, max_events, timeout);
+    if (rc < 0) {
+        return rc;
+    }
+
+    for (int i = 0; i < rc; i++) {
+        events[i].id = set->events[i].data.u64;
+        events[i].revents = 0;
+        if (set->events[i].events & EPOLLIN) {
+            events[i].revents |= FtpSocketPollType_IN;
+        }
+        if (set->events[i].events & EPOLLOUT) {
+            events[i].revents |= FtpSocketPollType_OUT;
+        }
+        if (set->events[i].events & (EPOLLERR | EPOLLHUP)) {
+            events[i].revents |= FtpSocketPollType_ERROR;
+        }
+    }
+
+    return rc;
+}
+#endif
+
 #define ftp_socket_open ftp_socket_open_unistd
 #define ftp_socket_recv ftp_socket_recv_unistd
 #define ftp_socket_send ftp_socket_send_unistd
@@ -241,12 +330,22 @@ static inline int ftp_socket_poll_unistd(struct FtpSocketPollEntry* entries, str
 #define ftp_socket_listen ftp_socket_listen_unistd
 #define ftp_socket_getsockname ftp_socket_getsockname_unistd
 #define ftp_socket_set_reuseaddr_enable ftp_socket_set_reuseaddr_enable_unistd
+#define ftp_socket_set_reuseport_enable ftp_socket_set_reuseport_enable_unistd
 #define ftp_socket_set_nodelay_enable ftp_socket_set_nodelay_enable_unistd
 #define ftp_socket_set_keepalive_enable ftp_socket_set_keepalive_enable_unistd
 #define ftp_socket_set_throughput_enable ftp_socket_set_throughput_enable_unistd
 #define ftp_socket_set_nonblocking_enable ftp_socket_set_nonblocking_enable_unistd
 #define ftp_socket_poll ftp_socket_poll_unistd
 
+#if defined(HAVE_EPOLL) && HAVE_EPOLL
+    #define ftp_socket_pollset_open ftp_socket_pollset_open_unistd
+    #define ftp_socket_pollset_close ftp_socket_pollset_close_unistd
+    #define ftp_socket_pollset_add ftp_socket_pollset_add_unistd
+    #define ftp_socket_pollset_mod ftp_socket_pollset_mod_unistd
+    #define ftp_socket_pollset_del ftp_socket_pollset_del_unistd
+    #define ftp_socket_pollset_wait ftp_socket_pollset_wait_unistd
+#endif
+
 #ifdef __cplusplus
 }
 #endif
@@ -3,6 +3,10 @@
  * SPDX-License-Identifier: MIT
  */
 
+#if (defined(HAVE_SPLICE) && HAVE_SPLICE) || (defined(HAVE_GETDENTS64) && HAVE_GETDENTS64)
+    #define _GNU_SOURCE // splice(), getdents64()
+#endif
+
 #include "ftpsrv_vfs.h"
 
 #include <stddef.h>
@@ -73,19 +77,63 @@ int ftp_vfs_opendir(struct FtpVfsDir* f, const char* path) {
     if (!f->fd) {
         return -1;
     }
+#if defined(FTP_VFS_READDIR_BATCH) && FTP_VFS_READDIR_BATCH
+    f->dents = NULL;
+    f->dents_off = f->dents_size = 0;
+#endif
     return 0;
 }
 
 const char* ftp_vfs_readdir(struct FtpVfsDir* f, struct FtpVfsDirEntry* entry) {
-    entry->buf = readdir(f->fd);
-    if (!entry->buf) {
+    const struct dirent* d = readdir(f->fd);
+    if (!d) {
         return NULL;
     }
-    return entry->buf->d_name;
+    entry->name = d->d_name;
+    return entry->name;
+}
+
+#if defined(FTP_VFS_READDIR_BATCH) && FTP_VFS_READDIR_BATCH
+#include <stdlib.h>
+
+// size of the buffer that getdents64() fills, so huge dirs take few syscalls.
+#define VFS_DENTS_SIZE (1024 * 64)
+
+int ftp_vfs_readdir_batch(struct FtpVfsDir* f, struct FtpVfsDirEntry* entries, const char** names, size_t max) {
+    // only refill once every entry has been returned, as the names point into the buffer.
+    if (f->dents_off >= f->dents_size) {
+        if (!f->dents && !(f->dents = malloc(VFS_DENTS_SIZE))) {
+            return -1;
+        }
+
+        const ssize_t n = getdents64(dirfd(f->fd), f->dents, VFS_DENTS_SIZE);
+        if (n <= 0) {
+            return n;
+        }
+
+        f->dents_off = 0;
+        f->dents_size = n;
+    }
+
+    size_t count = 0;
+    while (count < max && f->dents_off < f->dents_size) {
+        const struct dirent64* d = (const struct dirent64*)(f->dents + f->dents_off);
+        f->dents_off += d->d_reclen;
+        entries[count].name = names[count] = d->d_name;
+        count++;
+    }
+
+    return count;
 }
+#endif
 
 int ftp_vfs_dirlstat(struct FtpVfsDir* f, const struct FtpVfsDirEntry* entry, const char* path, struct stat* st) {
+#if defined(FTP_VFS_DIRLSTAT_AT) && FTP_VFS_DIRLSTAT_AT
+    // relative to the dir, so the kernel doesn't walk the full path for every entry.
+    return fstatat(dirfd(f->fd), entry->name, st, AT_SYMLINK_NOFOLLOW);
+#else
     return lstat(path, st);
+#endif
 }
 
 int ftp_vfs_closedir(struct FtpVfsDir* f) {
@@ -93,6 +141,10 @@ int ftp_vfs_closedir(struct FtpVfsDir* f) {
     if (ftp_vfs_isdir_open(f)) {
         rc = closedir(f->fd);
         f->fd = NULL;
+#if defined(FTP_VFS_READDIR_BATCH) && FTP_VFS_READDIR_BATCH
+        free(f->dents);
+        f->dents = NULL;
+#endif
     }
     return rc;
 }
@@ -133,11 +185,11 @@ int ftp_vfs_readlink(const char* path, char* buf, size_t buflen) {
 #endif
 }
 
+#include "../vfs_id_cache.h"
+
 #if defined(HAVE_GETPWUID) && HAVE_GETPWUID
-#include <pwd.h>
 const char* ftp_vfs_getpwuid(const struct stat* st) {
-    const struct passwd *pw = getpwuid(st->st_uid);
-    return pw ? pw->pw_name : "unknown";
+    return vfs_id_cache_getpwuid(st->st_uid);
 }
 #else
 const char* ftp_vfs_getpwuid(const struct stat* st) {
@@ -146,13 +198,317 @@ const char* ftp_vfs_getpwuid(const struct stat* st) {
 #endif
 
 #if defined(HAVE_GETGRGID) && HAVE_GETGRGID
-#include <grp.h>
 const char* ftp_vfs_getgrgid(const struct stat* st) {
-    const struct group *gr = getgrgid(st->st_gid);
-    return gr ? gr->gr_name : "unknown";
+    return vfs_id_cache_getgrgid(st->st_gid);
 }
 #else
 const char* ftp_vfs_getgrgid(const struct stat* st) {
     return "unknown";
 }
 #endif
+
+#if defined(HAVE_SPLICE) && HAVE_SPLICE
+// writes all of buf, used when a write was cut short.
+static int vfs_write_all(int fd, const unsigned char* buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        const ssize_t n = write(fd, buf + done, size - done);
+        if (n < 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return done;
+}
+#endif
+
+#if defined(HAVE_SENDFILE) && HAVE_SENDFILE
+#include "ftpsrv_socket.h"
+
+#include <errno.h>
+#include <sys/sendfile.h>
+
+// the kernel copies straight from the page cache to the socket, buf is not needed.
+int ftp_vfs_sendfile(struct FtpVfsFile* f, struct FtpSocket* sock, void* buf, size_t size, size_t off) {
+    off_t pos = off;
+    size_t sent = 0;
+
+    while (sent < size) {
+        const ssize_t n = sendfile(sock->s, f->fd, &pos, size - sent);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // report what was sent, the error is returned by the next call.
+            if (sent) {
+                break;
+            }
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+        sent += n;
+    }
+
+    return sent;
+}
+#endif
+
+#if defined(HAVE_SPLICE) && HAVE_SPLICE
+#include "ftpsrv_socket.h"
+
+#include <errno.h>
+
+// capacity requested for the splice pipe, the default is usually 64KiB.
+#ifndef FTP_VFS_PIPE_SIZE
+    #define FTP_VFS_PIPE_SIZE (1024 * 1024)
+#endif
+
+// the pipe is created on first use and kept for the lifetime of the process.
+// it is always empty between calls, so one pipe per thread is enough.
+struct VfsPipe {
+    int fds[2]; // 0 if not yet setup, -1 if the pipe could not be created.
+};
+
+#if defined(FTP_THREADS) && FTP_THREADS
+static __thread struct VfsPipe g_pipe;
+#else
+static struct VfsPipe g_pipe;
+#endif
+
+static struct VfsPipe* vfs_pipe_get(void) {
+    if (!g_pipe.fds[0]) {
+        if (pipe2(g_pipe.fds, O_CLOEXEC) < 0) {
+            g_pipe.fds[0] = g_pipe.fds[1] = -1;
+        } else {
+#ifdef F_SETPIPE_SZ
+            fcntl(g_pipe.fds[1], F_SETPIPE_SZ, FTP_VFS_PIPE_SIZE);
+#endif
+        }
+    }
+    return g_pipe.fds[0] < 0 ? NULL : &g_pipe;
+}
+
+// closes the pipe if data could not be moved out of it, a new one is created on next use.
+static void vfs_pipe_reset(struct VfsPipe* p) {
+    close(p->fds[0]);
+    close(p->fds[1]);
+    p->fds[0] = p->fds[1] = 0;
+}
+
+// moves everything in the pipe to the file, falls back to copying if the
+// file can't be spliced to (such as when opened with O_APPEND).
+static int vfs_pipe_drain(struct VfsPipe* p, int fd, void* buf, size_t size, size_t len) {
+    while (len) {
+        ssize_t n = splice(p->fds[0], NULL, fd, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINVAL) {
+            n = read(p->fds[0], buf, len < size ? len : size);
+            if (n > 0 && vfs_write_all(fd, buf, n) < 0) {
+                n = -1;
+            }
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            vfs_pipe_reset(p);
+            return -1;
+        }
+        len -= n;
+    }
+    return 0;
+}
+
+// data is moved socket -> pipe -> file without being copied to userspace.
+int ftp_vfs_recvfile(struct FtpVfsFile* f, struct FtpSocket* sock, void* buf, size_t size) {
+    struct VfsPipe* p = vfs_pipe_get();
+    if (!p) {
+        const int n = recv(sock->s, buf, size, 0);
+        if (n <= 0) {
+            return n;
+        }
+        return vfs_write_all(f->fd, buf, n);
+    }
+
+    size_t written = 0;
+    while (written < size) {
+        const ssize_t n = splice(sock->s, NULL, p->fds[1], NULL, size - written, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // report what was written, the error is returned by the next call.
+            if (written) {
+                break;
+            }
+            return -1;
+        } else if (n == 0) {
+            break;
+        }
+
+        if (vfs_pipe_drain(p, f->fd, buf, size, n) < 0) {
+            return -1;
+        }
+        written += n;
+    }
+
+    return written;
+}
+#endif
+
+#if defined(FTP_VFS_ASYNC) && FTP_VFS_ASYNC
+#include "ftpsrv_socket.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#ifndef FTP_VFS_ASYNC_MAX_THREADS
+    #define FTP_VFS_ASYNC_MAX_THREADS 64
+#endif
+
+struct FtpVfsAsync {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t threads[FTP_VFS_ASYNC_MAX_THREADS];
+    unsigned thread_count;
+    int quit;
+
+    // fifo of jobs waiting for a worker.
+    struct FtpVfsAsyncJob* pending_head;
+    struct FtpVfsAsyncJob* pending_tail;
+    // jobs that finished, order does not matter.
+    struct FtpVfsAsyncJob* done;
+
+    // a single byte is written to the pipe when done becomes non-empty.
+    int notified;
+    int pipe_write;
+    struct FtpSocket notify;
+};
+
+static void* vfs_async_thread(void* arg) {
+    struct FtpVfsAsync* async = arg;
+
+    pthread_mutex_lock(&async->mutex);
+    for (;;) {
+        while (!async->pending_head && !async->quit) {
+            pthread_cond_wait(&async->cond, &async->mutex);
+        }
+
+        // finish all queued jobs before exiting.
+        struct FtpVfsAsyncJob* job = async->pending_head;
+        if (!job) {
+            break;
+        }
+
+        async->pending_head = job->next;
+        if (!async->pending_head) {
+            async->pending_tail = NULL;
+        }
+
+        pthread_mutex_unlock(&async->mutex);
+        job->func(job);
+        pthread_mutex_lock(&async->mutex);
+
+        job->next = async->done;
+        async->done = job;
+        if (!async->notified) {
+            const char c = 0;
+            async->notified = write(async->pipe_write, &c, sizeof(c)) == sizeof(c);
+        }
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return NULL;
+}
+
+struct FtpVfsAsync* ftp_vfs_async_create(unsigned threads) {
+    if (!threads || threads > FTP_VFS_ASYNC_MAX_THREADS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct FtpVfsAsync* async = calloc(1, sizeof(*async));
+    if (!async) {
+        return NULL;
+    }
+
+    int fds[2];
+    if (pipe(fds) < 0) {
+        free(async);
+        return NULL;
+    }
+
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    async->notify.s = fds[0];
+    async->pipe_write = fds[1];
+
+    pthread_mutex_init(&async->mutex, NULL);
+    pthread_cond_init(&async->cond, NULL);
+
+    for (; async->thread_count < threads; async->thread_count++) {
+        if (pthread_create(&async->threads[async->thread_count], NULL, vfs_async_thread, async)) {
+            ftp_vfs_async_destroy(async);
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    return async;
+}
+
+void ftp_vfs_async_destroy(struct FtpVfsAsync* async) {
+    pthread_mutex_lock(&async->mutex);
+    async->quit = 1;
+    pthread_cond_broadcast(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    for (unsigned i = 0; i < async->thread_count; i++) {
+        pthread_join(async->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&async->cond);
+    pthread_mutex_destroy(&async->mutex);
+    close(async->notify.s);
+    close(async->pipe_write);
+    free(async);
+}
+
+int ftp_vfs_async_submit(struct FtpVfsAsync* async, struct FtpVfsAsyncJob* job) {
+    job->next = NULL;
+
+    pthread_mutex_lock(&async->mutex);
+    if (async->pending_tail) {
+        async->pending_tail->next = job;
+    } else {
+        async->pending_head = job;
+    }
+    async->pending_tail = job;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    return 0;
+}
+
+struct FtpVfsAsyncJob* ftp_vfs_async_complete(struct FtpVfsAsync* async) {
+    pthread_mutex_lock(&async->mutex);
+    struct FtpVfsAsyncJob* job = async->done;
+    if (job) {
+        async->done = job->next;
+    } else if (async->notified) {
+        char buf[64];
+        while (read(async->notify.s, buf, sizeof(buf)) > 0) {}
+        async->notified = 0;
+    }
+    pthread_mutex_unlock(&async->mutex);
+
+    return job;
+}
+
+struct FtpSocket* ftp_vfs_async_socket(struct FtpVfsAsync* async) {
+    return &async->notify;
+}
+#endif
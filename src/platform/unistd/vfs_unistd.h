@@ -9,6 +9,28 @@ extern "C" {
 #include <sys/stat.h>
 #include <dirent.h>
 
+// RETR uses sendfile() where available, otherwise read(). files are never mapped.
+#if defined(HAVE_SENDFILE) && HAVE_SENDFILE
+    #define FTP_VFS_SENDFILE 1
+#endif
+
+#if defined(HAVE_SPLICE) && HAVE_SPLICE
+    #define FTP_VFS_RECVFILE 1
+#endif
+
+// workers need the thread local server state, the pool is only started if vfs_threads is set.
+#if defined(FTP_THREADS) && FTP_THREADS
+    #define FTP_VFS_ASYNC 1
+#endif
+
+#if defined(HAVE_FSTATAT) && HAVE_FSTATAT
+    #define FTP_VFS_DIRLSTAT_AT 1
+#endif
+
+#if defined(HAVE_GETDENTS64) && HAVE_GETDENTS64
+    #define FTP_VFS_READDIR_BATCH 1
+#endif
+
 struct FtpVfsFile {
     int fd;
     int valid;
@@ -16,10 +38,16 @@ struct FtpVfsFile {
 
 struct FtpVfsDir {
     DIR* fd;
+#if defined(FTP_VFS_READDIR_BATCH) && FTP_VFS_READDIR_BATCH
+    // filled by getdents64(), entries before dents_off have been returned.
+    char* dents;
+    size_t dents_off;
+    size_t dents_size;
+#endif
 };
 
 struct FtpVfsDirEntry {
-    struct dirent* buf;
+    const char* name;
 };
 
 #ifdef __cplusplus
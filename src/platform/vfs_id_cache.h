@@ -0,0 +1,113 @@
+/**
+ * Copyright 2024 TotalJustice.
+ * SPDX-License-Identifier: MIT
+ */
+#pragma once
+
+// user and group names for listings, shared by the unistd and stdio vfs.
+// each vfs implements ftp_vfs_getpwuid() and ftp_vfs_getgrgid() with
+// vfs_id_cache_getpwuid() and vfs_id_cache_getgrgid().
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if (defined(HAVE_GETPWUID) && HAVE_GETPWUID) || (defined(HAVE_GETGRGID) && HAVE_GETGRGID)
+#include <string.h>
+#include <time.h>
+
+// number of users and of groups whose names are remembered, per thread.
+#define VFS_ID_CACHE_SIZE 64
+// seconds until a name is looked up again, so that changes to users and groups show up.
+#define VFS_ID_CACHE_TTL 60
+
+// the lookup may go through nss (ldap, sssd...), which is far too slow to do for every entry.
+struct VfsIdCacheEntry {
+    unsigned id;
+    time_t expires; // 0 if unused.
+    char name[64]; // empty if the id has no name.
+};
+
+static inline time_t vfs_id_cache_now(void) {
+#if defined(HAVE_CLOCK_GETTIME) && HAVE_CLOCK_GETTIME
+    struct timespec ts;
+    if (!clock_gettime(CLOCK_MONOTONIC, &ts)) {
+        return ts.tv_sec;
+    }
+#endif
+    return time(NULL);
+}
+
+// returns the name of the id, calling lookup() if it is not cached or has expired.
+static inline const char* vfs_id_cache_get(struct VfsIdCacheEntry* cache, unsigned id, const char* (*lookup)(unsigned id)) {
+    const time_t now = vfs_id_cache_now();
+    struct VfsIdCacheEntry* e = &cache[id % VFS_ID_CACHE_SIZE];
+
+    if (!e->expires || e->id != id || now >= e->expires) {
+        const char* name = lookup(id);
+        if (name && strlen(name) >= sizeof(e->name)) {
+            e->expires = 0;
+            return name;
+        }
+
+        // ids without a name are cached as well.
+        e->id = id;
+        e->expires = now + VFS_ID_CACHE_TTL;
+        strcpy(e->name, name ? name : "");
+    }
+
+    return e->name[0] ? e->name : "unknown";
+}
+#endif
+
+#if defined(HAVE_GETPWUID) && HAVE_GETPWUID
+#include <pwd.h>
+
+static inline const char* vfs_id_lookup_user(unsigned uid) {
+#if defined(FTP_THREADS) && FTP_THREADS && defined(HAVE_GETPWUID_R) && HAVE_GETPWUID_R
+    static __thread char buf[1024];
+    struct passwd pwd, *pw = NULL;
+    getpwuid_r(uid, &pwd, buf, sizeof(buf), &pw);
+#else
+    const struct passwd *pw = getpwuid(uid);
+#endif
+    return pw ? pw->pw_name : NULL;
+}
+
+static inline const char* vfs_id_cache_getpwuid(unsigned uid) {
+#if defined(FTP_THREADS) && FTP_THREADS
+    static __thread struct VfsIdCacheEntry cache[VFS_ID_CACHE_SIZE];
+#else
+    static struct VfsIdCacheEntry cache[VFS_ID_CACHE_SIZE];
+#endif
+    return vfs_id_cache_get(cache, uid, vfs_id_lookup_user);
+}
+#endif
+
+#if defined(HAVE_GETGRGID) && HAVE_GETGRGID
+#include <grp.h>
+
+static inline const char* vfs_id_lookup_group(unsigned gid) {
+#if defined(FTP_THREADS) && FTP_THREADS && defined(HAVE_GETGRGID_R) && HAVE_GETGRGID_R
+    static __thread char buf[1024];
+    struct group grp, *gr = NULL;
+    getgrgid_r(gid, &grp, buf, sizeof(buf), &gr);
+#else
+    const struct group *gr = getgrgid(gid);
+#endif
+    return gr ? gr->gr_name : NULL;
+}
+
+static inline const char* vfs_id_cache_getgrgid(unsigned gid) {
+#if defined(FTP_THREADS) && FTP_THREADS
+    static __thread struct VfsIdCacheEntry cache[VFS_ID_CACHE_SIZE];
+#else
+    static struct VfsIdCacheEntry cache[VFS_ID_CACHE_SIZE];
+#endif
+    return vfs_id_cache_get(cache, gid, vfs_id_lookup_group);
+}
+#endif
+
+#ifdef __cplusplus
+}
+#endif
@@ -133,6 +133,15 @@ static inline int ftp_socket_set_reuseaddr_enable_wii(struct FtpSocket* sock, in
 #endif
 }
 
+static inline int ftp_socket_set_reuseport_enable_wii(struct FtpSocket* sock, int enable) {
+#if defined(HAVE_SO_REUSEPORT) && HAVE_SO_REUSEPORT
+    const int option = 1;
+    return ftp_socket_setsockopt_wii(sock->s, SOL_SOCKET, SO_REUSEPORT, &option, sizeof(option));
+#else
+    return 0;
+#endif
+}
+
 static inline int ftp_socket_set_nodelay_enable_wii(struct FtpSocket* sock, int enable) {
 #if defined(HAVE_TCP_NODELAY) && HAVE_TCP_NODELAY
     const int option = 1;
@@ -221,6 +230,7 @@ static inline int ftp_socket_poll_wii(struct FtpSocketPollEntry* entries, struct
 #define ftp_socket_listen ftp_socket_listen_wii
 #define ftp_socket_getsockname ftp_socket_getsockname_wii
 #define ftp_socket_set_reuseaddr_enable ftp_socket_set_reuseaddr_enable_wii
+#define ftp_socket_set_reuseport_enable ftp_socket_set_reuseport_enable_wii
 #define ftp_socket_set_nodelay_enable ftp_socket_set_nodelay_enable_wii
 #define ftp_socket_set_keepalive_enable ftp_socket_set_keepalive_enable_wii
 #define ftp_socket_set_throughput_enable ftp_socket_set_throughput_enable_wii